@@ -2,56 +2,382 @@
  * Based on the editor of the same name by L. Peter Deutsch and Butler W. Lampson.
  * This version written by Charles Hawkins
  */
+#define _GNU_SOURCE  /* For copy_file_range */
 #include <stdlib.h>
 #include <stdio.h>
 #include <termios.h>
 #include <string.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include "qed.h"
 
 
-const char *dumpfile = "/tmp/qed-dump";
-const int dumprev = 1;
-const char up_arrow[4] = {0xE2, 0x86, 0x91, 0x00}; /* Unicode left-arrow glyph */
-const char left_arrow[4] = {0xE2, 0x86, 0x90, 0x00};
-const char *cmd_chars = "\"/=^<\n\rABCDEFGIJKLMPQRSTVW"; /* Characters typed by the user for each command */
-char *cmd_strings_verbose[26] = {"\"", "/", "=", "↑", "←", "\r\n", "\r\n", "APPEND", "BUFFER #", "CHANGE", "DELETE", "EDIT", "FINISHED", "GET #", "INSERT", "JAM INTO #", "KILL #", "LOAD #", "MODIFY", "PRINT", "QUICK", "READ FROM ", "SUBSTITUTE ", "TABS", "VERBOSE", "WRITE ON "}; /* Sequences typed by qed for each command in VERBOSE mode */
-char *cmd_strings_quick[26] = {"\"", "/", "=", "", "", "\r\n", "\r\n", "A", "B", "C", "D", "E", "F", "G", "I", "J", "K", "L", "M", "P", "Q", "R", "S", "T", "V", "W"}; /* Sequences typed by qed for each command in QUICK mode */
-char **cmd_strings = cmd_strings_verbose;
-const int cmd_addrs[26] = {0, 2, 1, 0, 1, 2, 2, 1, 0, 2, 2, 2, 0, 2, 1, 0, 0, 2, 2, 2, 0, 1, 2, 0, 0, 2}; /* The number of addresses taken by each command (same order as above) */
-const char *cmd_noconf = "\"/=^<\n\r"; /* Commands on this list are executed immediately, without the user typing a confirming . */ 
-const char *cmd_noaddr = "\"BFJKQTV";
-const int BUF_INCREMENT = 30; /* When a buffer runs out of space, we'll increase its size by this many characters */
-const int NUM_AUX_BUFS = 36; /* Number of aux buffers. They are named 0-9 and A-Z, so 36 in total */
+static const char *dumpfile = "/tmp/qed-dump";
+static const int dumprev = 2;
+static const char up_arrow[4] = {0xE2, 0x86, 0x91, 0x00}; /* Unicode left-arrow glyph */
+static const char left_arrow[4] = {0xE2, 0x86, 0x90, 0x00};
+static const char *cmd_chars = "\"/=^<\n\r!ABCDEFGHIJKLMNOPQRSTUVWXY"; /* Characters typed by the user for each command */
+static char *cmd_strings_verbose[33] = {"\"", "/", "=", "↑", "←", "\r\n", "\r\n", "FILTER THROUGH ", "APPEND", "BUFFER #", "CHANGE", "DELETE", "EDIT", "FINISHED", "GET #", "HEAP", "INSERT", "JAM INTO #", "KILL #", "LOAD #", "MODIFY", "NOTATION ", "ORDER", "PRINT", "QUICK", "READ FROM ", "SUBSTITUTE ", "TABS ", "UNLOAD #", "VERBOSE", "WRITE ON ", "EVERY ", "YIELD"}; /* Sequences typed by qed for each command in VERBOSE mode */
+static char *cmd_strings_quick[33] = {"\"", "/", "=", "", "", "\r\n", "\r\n", "!", "A", "B", "C", "D", "E", "F", "G", "H", "I", "J", "K", "L", "M", "N", "O", "P", "Q", "R", "S", "T", "U", "V", "W", "X", "Y"}; /* Sequences typed by qed for each command in QUICK mode */
+static char **cmd_strings = cmd_strings_verbose;
+static FILE *term_in;  /* Where qed reads what the user types and where it types back: the terminal, or in server mode the request and response of the client being served */
+static FILE *term_out;
+static int scripted = 0;  /* Set when commands come from server clients or through libqed rather than from a terminal. The echo of commands isn't wanted then, and running out of input partway through a command just drops it */
+static int quiet = 0;  /* Set while such a command is being read, so that its echo isn't typed at all */
+static const int cmd_addrs[33] = {0, 2, 1, 0, 1, 2, 2, 2, 1, 0, 2, 2, 2, 0, 2, 0, 1, 0, 0, 2, 2, 0, 2, 2, 0, 1, 2, 0, 1, 0, 2, 2, 0}; /* The number of addresses taken by each command (same order as above) */
+static const char *cmd_noconf = "\"/=^<\n\r"; /* Commands on this list are executed immediately, without the user typing a confirming . */ 
+static const char *cmd_noaddr = "\"BFHJKNQTVY";
+static const int BUF_INCREMENT = 30; /* Space a new empty string starts out with, and the least it grows by when it runs out (see reserve_space) */
+static const int NUM_AUX_BUFS = 36; /* Number of aux buffers. They are named 0-9 and A-Z, so 36 in total */
+static const int SHARED = -1; /* Value of a string's space when its buf is reference-counted line text that must not be written to */
+static const char *PASTE_BEGIN = "\x1b[200~"; /* The terminal puts these around pasted text in bracketed paste mode */
+static const char *PASTE_END = "\x1b[201~";
+static const int SWAPPED = -2; /* Value of a string's space when its text has been paged out to the swap file, leaving only its swap_offset */
+static const int PAGE_LINES = 256; /* Lines of the main buffer are paged out to the swap file this many at a time */
+static const long READ_AHEAD = 1 << 20; /* When a paged-out line is needed, up to this many bytes of the lines after it are read back too */
+static const long BACKGROUND_READ_SIZE = 16 << 20; /* READ FROM loads files at least this big on a separate thread, so that the start of the file can be worked on while the rest loads */
+static const int LOAD_CHUNK = 1 << 20; /* How much of the file the loading thread reads at a time; the lines in each chunk are handed over together */
+static const int PACK_CACHE = 16; /* In compressed paging mode, this many of the most recently unpacked pages of swap text are kept around unpacked */
+static const int INTERN_BUCKETS = 1024; /* Initial number of buckets in the line intern table; it doubles whenever it fills up */
+static const int MAX_TABS = 12; /* Most tab stops that can be set with TABS */
+static const int TAB_COLUMNS = 256; /* Tab stops can be set in columns 1 to TAB_COLUMNS-1 */
+static const char *default_tabs = "8,16,24,32"; /* Tab stops until TABS sets others */
+static const int SEARCH_CACHE = 8; /* Number of recent searches each state keeps the matching lines of */
+static const long SEARCH_PATCH_LINES = 1024; /* Edits adding more lines than this drop cached search matches rather than checking every new line against them */
+static const int INDEX_BUCKETS = 1 << 16; /* A search index hashes trigrams, and tags, into this many posting lists each */
+static const int INDEX_VERSION = 1; /* Goes up whenever the layout of search index sidecars changes, so that old ones are built again */
+static const int MAX_DFA_STATES = 1024; /* A pattern's DFA that gets this many states is thrown away and started again, so that no pattern can take much more than a megabyte */
+static const long ARENA_BLOCK = 4096; /* The parser arena takes memory from the heap in blocks of at least this many bytes */
+static const long SORT_PARALLEL_LINES = 1 << 16; /* ORDER splits the sort between one thread per processor once there are at least this many lines */
+static const int MAX_SORT_JOBS = 64; /* Most threads ORDER sorts with */
+static const int ORDER_REVERSE = 1; /* Options of ORDER, kept in the num member of its command spec */
+static const int ORDER_NUMERIC = 2;
+static const int ORDER_UNIQUE = 4;
 
 /* Flags for use in various functions */
-const int FL_NONE = 0;
-const int FL_ECHO = 1;
-const int FL_FULL = 2;
-const int FL_ONELINE = 4;
-const int FL_LITERAL = 8;
-const int FL_REALLOC = 16;
-const int FL_SKIP = 32;
-const int FL_CONVERT = 64;
+enum {
+	FL_NONE = 0,
+	FL_ECHO = 1,
+	FL_FULL = 2,
+	FL_ONELINE = 4,
+	FL_LITERAL = 8,
+	FL_REALLOC = 16,
+	FL_SKIP = 32,
+	FL_CONVERT = 64
+};
 #define set_flags(var,flags) var |= (flags);
 #define unset_flags(var,flags) var &= ^(flags);
 /* Structure keeping track of a string buffer */
 struct string {
-	int length;
+	long length;
+	long space;
+	union {
+		char *buf;
+		long swap_offset;  /* Where the text of a SWAPPED string is in the swap file */
+	};
+};
+/* Header in front of the text of every line in the main buffer. Strings whose space is SHARED have their buf pointing at text[],
+   so the same text can be held by several strings (and by several lines, if interning is on) and is only freed once refs drops to 0.
+   Text held this way is never modified in place; edits build a new string and release the old text */
+struct line_text {
+	long refs;
+	unsigned int hash;
+	struct line_text *next;  /* Next entry in the same bucket of the intern table */
+	long swap_offset;  /* Where a copy of the text has been written in the swap file, or -1 if it hasn't been */
+	char text[];
+};
+/* Hash table of line texts, used to store identical lines only once when interning is turned on with -i */
+struct intern_table {
+	struct line_text **buckets;
+	long num_buckets;
+	long count;
+};
+static int intern_lines = 0;
+static int keep_indexes = 0;  /* Set by -x: searches of a file read with READ FROM go through an index of its lines, which is saved beside it to be used again */
+static struct intern_table line_pool = {NULL, 0, 0};
+/* A page of text paged out in compressed mode. In that mode the swap space only exists as a series of these, the page covering bytes
+   start to start+length of it holding them packed with lz_compress. Once no SWAPPED string refers to the page its data is freed */
+struct packed_page {
+	long start;
+	long length;
+	long packed_length;
+	char *data;
+	long refs;
+};
+/* A packed page that has been unpacked, kept in the pager's cache */
+struct unpacked_page {
+	int page;  /* Index of the packed page, or -1 for an empty slot */
+	char *text;
+};
+/* State of the paged storage mode turned on with -p, where the text of main buffer lines is written out to a swap file and read back when
+   needed so that no more than limit bytes of it are in memory at once. Pages of PAGE_LINES lines are chosen for writing out with the clock algorithm.
+   With -z the same happens, except that the swap space is kept in memory as compressed pages rather than in a file */
+struct pager {
+	FILE *swap;
+	long swap_end;
+	int compress;
+	struct packed_page *packed;
+	int num_packed;
+	int packed_space;
+	struct unpacked_page *cache;
+	int cache_hand;  /* The cache slot the next unpacked page goes in */
+	long limit;  /* Most bytes of line text to keep in memory, or 0 if paging is off */
+	long resident;  /* Bytes of line text currently in memory */
+	unsigned char *used;  /* One flag per page of the main buffer, set whenever a line in it is looked at */
+	long num_pages;
+	long hand;  /* The next page the clock will consider writing out */
+	int failed;  /* Set when writing to the swap space failed, for the command under way to report */
+};
+static struct pager pager = {NULL, 0, 0, NULL, 0, 0, NULL, 0, 0, 0, NULL, 0, 0, 0};
+/* Recording of the keystrokes typed in a session, turned on with -r, and replay of such a recording in place of the terminal, with -R.
+   A recording is the signature QEDK followed by one record per keystroke: when it was typed, in microseconds since qed started, as a
+   64-bit number, then the byte itself. Replays run as fast as they can unless -T asks for the original pacing, and report how long they took */
+struct session {
+	FILE *record;
+	FILE *replay;
+	int paced;
+	long start;  /* When qed started, in microseconds */
+	long keys;  /* Keystrokes replayed so far */
+	long commands;  /* Commands run during the replay, how long they took in all, and how long the slowest took, in microseconds */
+	long command_time;
+	long slowest;
+	long allocations;  /* Heap allocations made while reading and running those commands, and how many of them were made while reading */
+	long parse_allocations;
+};
+static struct session session = {NULL, NULL, 0, 0, 0, 0, 0, 0, 0, 0};
+/* The lines matching a recently used search, so that a search repeated between edits is a binary search rather than a scan of the main buffer.
+   The matches are worked out the second time a search is used, and kept up to date by lines_changed while they are small edits away */
+/* One step of a pattern, matching one byte out of a set, or with REPEAT any number of them */
+struct pattern_item {
+	unsigned char bytes[32];  /* Bit set of the bytes it matches */
+	int repeat;  /* Set when it was followed by *, so that it matches any number of those bytes, none included */
+};
+/* A DFA running a list of pattern items over text. Each state is the set of how many of the items could have been matched so far,
+   with bit num_items set once all of them have. States are only made as the text calls for them, and the transitions out of each
+   are worked out the first time they are taken */
+struct dfa {
+	struct pattern_item *items;
+	int num_items;
+	int unanchored;  /* Set if a match can start anywhere, rather than only where the DFA was started */
+	int words;  /* The number of unsigned longs in each state's set */
+	int num_states;  /* State 0 is dead, with nothing left that could match, and state 1 is the start */
 	int space;
-	char *buf;
+	long restarts;  /* Goes up each time the DFA gets too big and is started again, leaving any state number held onto meaningless */
+	unsigned long *sets;
+	char *accepts;  /* For each state, whether all the items have been matched */
+	int *next;  /* next[state * 256 + byte] is the state reached by reading byte in state, or -1 until it has been worked out */
+	int *buckets;  /* Open hash table of the states by their sets, twice space long, -1 where empty */
+	unsigned long *scratch;  /* Room for one set */
+};
+/* A pattern typed with NOTATION PATTERNS on, such as ^foo.*[0-9]$, compiled into items along with the DFAs that run them */
+struct pattern {
+	struct pattern_item *items;
+	struct pattern_item *reversed;  /* The items last to first */
+	int num_items;
+	int anchored;  /* Set if it began with ^, or is a tag, so that it only matches at the start of a line */
+	int at_end;  /* Set if it ended in $, whose item matches the \n at the end of a line */
+	struct dfa search;  /* Whether a line has a match anywhere (or at the start, if anchored) */
+	struct dfa longest;  /* Always anchored: the longest match starting at a given place */
+	struct dfa starts;  /* The reversed items, run backward from the end of a line: where matches start */
+	char *begins;  /* For SUBSTITUTE, whether a match starts at each place in the line */
+	long begins_space;
+};
+struct search_result {
+	struct string search;
+	int is_tag;
+	int patterns;  /* Set if the search was made with NOTATION PATTERNS on */
+	struct pattern *pattern;  /* The search compiled as a pattern, or NULL if it is literal or isn't a good pattern, which nothing matches */
+	long generation;  /* The edit_generation the matches are up to date with, or -1 if there aren't any */
+	long *matches;  /* Numbers of the matching lines, in order */
+	long num_matches;
+	long space;
+	long last_used;
+};
+static long edit_generation = 0;  /* Goes up with every change to the text of a main buffer */
+static long search_clock = 0;  /* Goes up with every search, to tell which cached search was used least recently */
+/* Memory accounting for the HEAP command. Everything qed allocates for itself goes through mem_alloc, mem_realloc and mem_free, which charge
+   it to one of these subsystems. Blocks are counted at their usable size, so what is shown is what malloc actually handed out */
+static const int MEM_TEXT = 0;  /* Text of lines, in line_text blocks */
+static const int MEM_LINES = 1;  /* Line tables: the arrays of strings making up the main buffer, LOADed aux buffers, and lines on their way into the main buffer */
+static const int MEM_STRINGS = 2;  /* Strings that aren't lines: the text of aux buffers, pasted text, command arguments and lines being typed or edited */
+static const int MEM_STACK = 3;  /* The stack of buffers being executed */
+static const int MEM_PARSER = 4;  /* Commands and addresses being parsed */
+static const int MEM_PAGER = 5;  /* Paging tables, compressed pages and unpacked pages */
+static const int MEM_OTHER = 6;  /* States, the intern table, the search cache, loaders, server clients and libqed sessions */
+static const char *mem_names[7] = {"LINE TEXT", "LINE TABLES", "STRINGS", "BUFFER STACK", "PARSER", "PAGER", "OTHER"};
+struct mem_account {
+	long bytes;
+	long blocks;
+	long peak;  /* Most bytes there have been at once */
+	long made;  /* Allocations made, each reallocation counting as one */
+};
+static struct mem_account memory[7];
+/* A bump arena for what get_command allocates: the command_spec, its line_specs and the strings typed into them. These only live until the
+   command has been run, so rather than being freed one by one they all go at once when the arena is reset, which keeps its blocks for the next command */
+struct arena_block {
+	struct arena_block *next;
+	long size;  /* Bytes in data */
+	char data[];
+};
+struct arena {
+	struct arena_block *first;
+	struct arena_block *current;  /* The block being allocated from */
+	long used;  /* Bytes of current already allocated */
+	char *last;  /* The most recent allocation, which can grow in place */
+};
+static struct arena parser_arena = {NULL, NULL, 0, NULL};
+static __thread struct arena *scratch = NULL;  /* The parser arena while get_command is reading a command, so that new strings take their buffers from it. Only the main thread parses, so the other threads never see it set */
+/* Lines held by an aux buffer that was filled by LOAD or GET. Each entry shares its text with the line it was taken from, so filling a buffer
+   this way never copies text; the lines are only joined into the buffer's string (with \r in place of each \n) when something needs it flat */
+struct span_list {
+	struct string *lines;
+	long num_lines;
 };
 /* Structure specifying the current state of the program, including the contents of the main and numbered buffers,
 the current and last lines (dot and dollar), the file read from, and whether we're in quick mode. */
 struct state_spec {
 	struct string *main_buffer;
 	struct string *aux_buffers;
-	int dot;
-	int dollar;
+	struct span_list *aux_spans;
+	long dot;
+	long dollar;
 	FILE *file;
 	int quick;
 	int wrote_out;
 	struct buffer_pos *buffer_stack;
+	struct string paste;  /* Text pasted into APPEND/INSERT/CHANGE that hasn't been turned into lines yet */
+	long paste_pos;
+	struct loader *loader;  /* File being loaded in the background by READ FROM, or NULL if there isn't one */
+	long loaded_words;  /* WORDS count of a background READ FROM that has finished but not been reported yet, or -1 */
+	int errors;  /* Number of times err has been called; server mode uses it to mark responses that had errors */
+	unsigned char tabs[256];  /* For each column, how many spaces a tab typed there expands to, or 0 if there are no more tab stops after it */
+	int tabs_set;  /* Set once TABS has been given, after which READ FROM expands the tabs in files too */
+	struct search_result *searches;  /* SEARCH_CACHE recent searches, or NULL before the first */
+	struct source *source;  /* The file the main buffer was read from, or NULL if it isn't being kept track of */
+	long *marks;  /* Lines an EVERY has still to call a buffer on, which lines_changed keeps in step with edits the buffer makes. 0 for a marked line that has gone */
+	long num_marks;
+	int patterns;  /* Set by NOTATION PATTERNS, after which searches, EVERY and SUBSTITUTE take patterns rather than literal strings */
+};
+/* The file the main buffer was last read from or written out to in full, so that WRITE ON back to it only has to write the lines that have changed since.
+   offsets has, for every line whose text is still just as it is in the file, where it starts in the file, and -1 for every other line. The file is
+   only trusted while it still has the size and modification time it had when it was read or written */
+struct source {
+	dev_t device;
+	ino_t inode;
+	off_t size;
+	struct timespec modified;
+	long *offsets;  /* Indexed by line number, like the main buffer */
+	long space;
+	struct line_index *index;  /* Search index of the lines as they were read, with -x, or NULL */
+};
+/* The start of a search index, as saved in its sidecar file. The index's tables follow it */
+struct index_header {
+	char magic[4];  /* "QEDX" */
+	int version;
+	long size;  /* The size, modification time and hash of the contents of the file the index is of, and how many lines it has */
+	long modified_sec;
+	long modified_nsec;
+	unsigned long hash;
+	long num_lines;
+	long trigram_bytes;  /* How long all the posting lists of each table are together */
+	long tag_bytes;
+};
+/* A search index of the lines read from a source. There are two tables of posting lists, each list giving the lines in which one of a bucket of keys
+   appears: the trigrams (runs of three bytes) in the line, and its tag (the letters and digits it starts with). A list is of the gaps from one line
+   number to the next, 7 bits to a byte with the top bit set on all but the last byte of each. Laid out in memory just as in the sidecar */
+struct line_index {
+	char *path;  /* The sidecar: the source's path with .qedx on the end */
+	unsigned long hash;  /* Hash of the lines read, from hash_line */
+	long generation;  /* The edit_generation the READ FROM left the main buffer at, or -1 until it has finished. The index is only good until it changes */
+	struct index_header *header;  /* NULL until the index has been mapped from the sidecar or built */
+	long length;
+	int mapped;
+	long *trigram_starts;  /* Where each list starts in trigram_postings, with one more for where the last ends */
+	long *tag_starts;
+	unsigned char *trigram_postings;
+	unsigned char *tag_postings;
+};
+/* A READ FROM that is loading its file on a separate thread. The thread splits the file into lines and hands them over in lines as it goes;
+   the main thread moves them into the main buffer before each command, and waits for the rest when a command needs it (see absorb_lines) */
+struct loader {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	FILE *file;
+	struct string *lines;  /* Lines read by the thread that haven't been moved into the main buffer yet */
+	long num_lines;
+	long space;
+	long num_bytes;
+	int done;  /* Set by the thread when it has reached the end of the file */
+	long insert_at;  /* Line of the main buffer that the next lines go in front of */
+	long dot;  /* Where the last absorb_lines left dot. Dot follows the end of the loaded lines until a command moves it */
+	int expand;  /* Whether to expand the file's tabs, with this copy of the tab table */
+	unsigned char tabs[256];
+	int track;  /* Whether the file is becoming the state's source, and where in it the lines yet to be absorbed start */
+	long offset;
+	unsigned long hash;  /* With -x, hash_line of the lines read so far, for the source's index */
+};
+/* A READ FROM of a pipe, FIFO or other file that can only be read straight through. A thread reads it LOAD_CHUNK bytes at a time into one
+   buffer while the main thread splits the other into lines, so that whatever is writing to the pipe never has to wait on the splitting */
+struct stream {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;  /* Signalled whenever a buffer is filled or emptied, or stop is set */
+	int fd;
+	char *buffers[2];
+	long lengths[2];  /* Bytes read into each buffer, or -1 while it is the reading thread's to fill */
+	int stop;  /* Set by the main thread if it finds the end of the text before the end of the file */
+};
+/* A line being sorted by ORDER. The first 8 bytes of its text, or the number it starts with for a numeric sort, are kept with the line's number
+   so that most comparisons are settled without going to the text, and the keys are small enough for the sort to move them around cheaply */
+struct sort_key {
+	unsigned long prefix;
+	long line;
+};
+/* One thread's share of an ORDER: sorting a run of keys, or merging two sorted runs that lie next to each other */
+struct sort_job {
+	struct sort_key *keys;
+	struct sort_key *spare;  /* Scratch space for the job, as long as its run */
+	long length;
+	long half;  /* Where the second of the runs being merged starts, or 0 to sort */
+	int order;
+	struct string *lines;  /* The main buffer the keys' lines are in */
+};
+/* One line of a SUBSTITUTE:T table, such as /new/old/. Its strings are kept as slices of the table's text */
+struct replace_pair {
+	long line;
+	long line_length;
+	long replace;
+	long replace_length;
+	long find;
+	long find_length;
+	long count;  /* Replacements made with this pair so far */
+};
+/* The table of a SUBSTITUTE:T, with an Aho-Corasick automaton built from the old strings of all its pairs, so that a line is searched for all of them at once */
+struct replace_table {
+	struct string text;
+	struct replace_pair *pairs;
+	long num_pairs;
+	unsigned char classes[256];  /* Bytes are read as classes; those that appear in none of the old strings all share class 0 */
+	int num_classes;
+	long num_states;  /* State 0 is the root, where nothing has been matched */
+	int *next;  /* next[state * num_classes + class] is the state reached by reading a byte of the class in the state */
+	int *depth;  /* How many bytes of text each state stands for */
+	int *match;  /* The pair with the longest old string ending at each state, or -1 */
 };
 /* Complete command specifier, including starting and ending lines, the command, 0-2 arguments, flags */
 struct command_spec {
@@ -61,7 +387,8 @@ struct command_spec {
 	struct string arg1;
 	struct string arg2;
 	char flag;
-	int num;
+	long num;
+	struct command_spec *sub;  /* For EVERY, the command run on each of the lines it marks */
 };
 
 /* Structure containing a line specifier as entered on the command line. Can be absolute or relative, numerical or search-based. 
@@ -69,71 +396,232 @@ struct command_spec {
 struct line_spec {
 	char sign;
 	char type;
-	int line;
+	long line;
 	struct string search;
 	struct line_spec *next;
 };
 
+/* A connection to a qed server. Each client has its own state, with its own dot, quick mode and aux buffers, but its main buffer is the server's:
+   the server moves the shared main buffer into the client's state while it runs the client's commands (see serve_request) */
+struct client {
+	int fd;
+	struct state_spec *state;
+	struct string request;  /* Bytes received that don't make up a whole request yet */
+};
+
 /* Because a buffer can itself contain buffer calls, including to the same buffer, we need a stack of buffers we're executing from, including the buffer and position within each buffer for each stack entry
  * This structure contains the stack of buffers currently being read from. Base pointer is to the current / innermost buffer, *prev points to the one outside of that (i.e. to be returned to when this one is done), and so on. If the base pointer is NULL it means we are just executing from stdin */
 struct buffer_pos {
-	int current_char;
+	long current_char;
 	int buf_num;
 	struct buffer_pos *prev;
 };
-void dbg_string(struct string *s)
+static __attribute__((unused)) void dbg_string(struct string *s)
+/* Types out a string's space, length and bytes, for debugging */
 {
 	if(!s)
 	{
-		printf("<NULL>");
+		fprintf(term_out, "<NULL>");
 		return;
 	}
-	printf("<s:%i l:%i b:[", s->space, s->length);
+	fprintf(term_out, "<s:%li l:%li b:[", s->space, s->length);
 	if(!s->buf)
-		printf("NULL");
-	for(int i=0; i<=s->length; i++)
-		printf(" %02x",s->buf[i]);
-	printf(" ]>");
-}
-void err(struct state_spec *state);
-struct string *new_string();
-struct string *empty_string(struct string *s);
-struct string *string_with_capacity(struct string *s, int space);
-struct string *string_from_cstring(struct string *s, char *cs);
-struct string *capture_cstring(struct string *s, char *cs, int space);
-void delete_string(struct string *s);
-void free_string(struct string *s);
-struct string *copy_string(struct string *dst, struct string *src, int copy_space);
-struct string *cat_slice(struct string *dst, struct string *src, int start, int length);
-void cat_strings(struct string *s1, struct string *s2);
-int print_string(struct string *s);
-struct string *read_string_from_file(struct string *s, int length, FILE *f);
-int buffer_for_char(char c);
-void kill_buffer(int buffer_num, struct state_spec *state);
-void set_buffer(int buffer_num, struct string *new_text, struct state_spec *state);
-int find_string(struct string *search, int start_line, int is_tag, struct state_spec *state);
-int substitute(struct string *replace, struct string *find, int start, int end, char mode, int num, struct state_spec *state);
-char convert_esc(char c, struct state_spec *state);
-int next_char(char *c, int convert, int echo, int ctl_v, struct state_spec *state);
-void **replace_elements_in_vector(void **dest, int *dest_length, void **src, int src_length, int pos, int num);
-void add_char_to_string(struct string *str, char c, int realloc, int echo, int skip, struct string *lbuf);
-char get_flags(struct command_spec *command, struct state_spec *state);
-void get_buffer_name(struct command_spec *command, struct state_spec *state);
-int get_string(struct string *str, char delim, int full, int unlimited, int literal, int oneline, struct string *oldline, struct state_spec *state);
-struct string *get_lines(int *length, int literal, struct state_spec *state);
-struct command_spec* get_command(struct state_spec *state);
-int resolve_line_spec(struct line_spec *line, struct state_spec *state);
-int execute_command(struct command_spec *command, struct state_spec *state);
-int increase_buffer(char **buffer, size_t *size);
-struct line_spec *new_line_spec(char sign, char type, int line, struct string *search);
-void free_line_spec(struct line_spec *ls);
-void free_command_spec(struct command_spec *cmd);
-void free_buffer_stack(struct buffer_pos *stack);
-void free_state_spec(struct state_spec *state);
-char print_char(char c);
-int print_buffer(char *buf);
-void dump_state(struct state_spec *state);
-struct state_spec* restore_state();
+		fprintf(term_out, "NULL");
+	for(long i=0; i<=s->length; i++)
+		fprintf(term_out, " %02x",s->buf[i]);
+	fprintf(term_out, " ]>");
+}
+/* Everything but the qed_* functions of qed.h is static, so that libqed, built with -DQED_NO_MAIN, exports nothing else. The few functions
+   that only main calls, and helpers kept for debugging, are marked unused so that neither build warns about them */
+static void err(struct state_spec *state);
+static struct string *new_string();
+static struct string *empty_string(struct string *s);
+static struct string *string_with_capacity(struct string *s, long space);
+static struct string *string_from_cstring(struct string *s, char *cs);
+static __attribute__((unused)) struct string *capture_cstring(struct string *s, char *cs, long space);
+static void delete_string(struct string *s);
+static void free_string(struct string *s);
+static struct string *copy_string(struct string *dst, struct string *src, int copy_space);
+static struct string *cat_slice(struct string *dst, struct string *src, long start, long length);
+static void cat_strings(struct string *s1, struct string *s2);
+static void reserve_space(struct string *s, long space);
+static void free_buf(struct string *s);
+static struct line_text *text_header(char *buf);
+static unsigned int hash_text(char *buf, long length);
+static struct string *intern_string(struct string *s);
+static struct string *intern_slice(struct string *s, char *text, long length);
+static struct string *share_string(struct string *dst, struct string *src);
+static void release_text(char *buf);
+static int print_string(struct string *s);
+static struct string *read_string_from_file(struct string *s, long length, FILE *f);
+static int buffer_for_char(char c);
+static void kill_buffer(int buffer_num, struct state_spec *state);
+static void set_buffer(int buffer_num, struct string *new_text, struct state_spec *state);
+static void set_buffer_lines(int buffer_num, struct string *lines, long num_lines, struct state_spec *state);
+static struct string *aux_buffer(int buffer_num, struct state_spec *state);
+static struct string *buffer_lines(int buffer_num, long *num_lines, struct state_spec *state);
+static struct string *split_lines(char *text, long length, char separator, long *num_lines);
+static struct string *get_line(long line, struct state_spec *state);
+static void page_in(long line, struct state_spec *state);
+static int page_out_lines(struct string *lines, long first, long last);
+static void make_room(struct state_spec *state);
+static void swap_read(char *dst, long length, long offset);
+static int swap_write(char *src, long length);
+static int swap_live(long offset);
+static void swap_ref(long offset, long delta);
+static int find_packed_page(long offset);
+static char *unpack_page(int page);
+static void *unpack_job(void *arg);
+static long lz_compress(char *src, long length, char *dst);
+static long lz_sequence(unsigned char *dst, long pos, unsigned char *literals, long num_literals, int offset, long match);
+static long lz_decompress(char *src, long length, char *dst);
+static long find_string(struct string *search, long start_line, int is_tag, int backward, struct state_spec *state);
+static int line_matches(char *text, struct search_result *result);
+static struct pattern *new_pattern(struct string *text, int is_tag);
+static char *get_class(char *p, char *end, struct pattern_item *item);
+static int pattern_open(struct string *pattern);
+static void free_pattern(struct pattern *pattern);
+static void init_dfa(struct dfa *dfa, struct pattern_item *items, int num_items, int unanchored);
+static int dfa_state(struct dfa *dfa, unsigned long *set);
+static int dfa_step(struct dfa *dfa, int state, unsigned char byte);
+static void close_set(struct dfa *dfa, unsigned long *set);
+static void free_dfa(struct dfa *dfa);
+static int pattern_search(struct pattern *pattern, char *text);
+static long longest_match(struct pattern *pattern, struct string *text, long start);
+static void find_starts(struct pattern *pattern, struct string *text);
+static long next_match(struct string *text, long from, long empty_from, struct string *find, struct pattern *pattern, long *length);
+static struct search_result *cached_search(struct string *search, int is_tag, struct state_spec *state);
+static void find_matches(struct search_result *result, struct state_spec *state);
+static long first_match_from(struct search_result *result, long line);
+static void replace_lines(struct state_spec *state, struct string *lines, long num_lines, long pos, long num);
+static void lines_changed(struct state_spec *state, long pos, long removed, long added);
+static void patch_searches(struct state_spec *state, long pos, long removed, long added);
+static long mark_lines(struct string *pattern, long first, long last, long **marks, struct state_spec *state);
+static void delete_marked(struct state_spec *state, long *marks, long num_marks);
+static int every_line(struct command_spec *command, long first, long last, struct state_spec *state);
+static int call_buffer(int buf_num, struct state_spec *state);
+static long stack_depth(struct buffer_pos *stack);
+static long order_lines(long first, long last, int order, struct state_spec *state);
+static unsigned long number_key(char *text);
+static int compare_keys(struct sort_key *a, struct sort_key *b, struct sort_job *job);
+static void sort_keys(struct sort_key *keys, struct sort_key *spare, long length, struct sort_job *job);
+static void merge_keys(struct sort_key *keys, struct sort_key *spare, long length, long half, struct sort_job *job);
+static void *sort_job(void *arg);
+static void run_sort_jobs(struct sort_job *jobs, int num_jobs);
+static void start_source(struct state_spec *state, int fd);
+static long source_lines(struct state_spec *state, long first, long num_lines, long offset);
+static void check_source(struct state_spec *state, int fd, long num_bytes, long last_line);
+static int is_source(struct state_spec *state, struct stat *file_stat);
+static void dirty_lines(struct state_spec *state, long pos, long removed, long added);
+static void free_source(struct source *source);
+static unsigned long hash_line(unsigned long hash, struct string *line);
+static struct line_index *new_line_index(char *path);
+static void finish_index(struct state_spec *state, unsigned long hash);
+static int map_index(struct line_index *index, struct source *source, long num_lines);
+static int check_starts(long *starts, long bytes);
+static void build_index(struct line_index *index, struct state_spec *state);
+static void place_tables(struct line_index *index);
+static long index_table(int tags, long *starts, unsigned char *postings, struct state_spec *state);
+static int put_gap(unsigned char *p, unsigned long gap);
+static int trigram_bucket(char *text);
+static int tag_bucket(char *text, long length);
+static struct line_index *ready_index(struct state_spec *state);
+static int index_matches(struct line_index *index, struct search_result *result, struct state_spec *state);
+static long read_postings(unsigned char *p, unsigned char *end, long *lines, long last);
+static long get_gap(unsigned char **p, unsigned char *end, long room);
+static void add_match(struct search_result *result, long line);
+static void free_index(struct line_index *index);
+static int write_changes(char *path, long *bytes_written, struct state_spec *state);
+static int flush_written(int fd, char *buf, long *length, long *position);
+static long substitute(struct string *replace, struct string *find, struct pattern *pattern, long start, long end, char mode, long num, struct state_spec *state);
+static struct replace_table *load_table(struct command_spec *command, struct state_spec *state);
+static int parse_table(struct replace_table *table);
+static void build_automaton(struct replace_table *table);
+static long substitute_table(struct replace_table *table, long start, long end, long num, struct state_spec *state);
+static void report_table(struct replace_table *table);
+static void free_table(struct replace_table *table);
+static char convert_esc(char c, struct state_spec *state);
+static int read_paste(struct state_spec *state);
+static int get_pasted_line(struct string *str, struct state_spec *state);
+static int next_char(char *c, int convert, int echo, int ctl_v, struct state_spec *state);
+static int read_byte();
+static long microseconds();
+static void report_replay();
+static __attribute__((unused)) void **replace_elements_in_vector(void **dest, long *dest_length, void **src, long src_length, long pos, long num);
+static struct string *replace_elements_in_string_vector(struct string *dest, long *dest_length, struct string *src, long src_length, long pos, long num);
+static void *mem_alloc(size_t size, int subsystem);
+static void *mem_calloc(size_t num, size_t size, int subsystem);
+static void *mem_realloc(void *p, size_t size, int subsystem);
+static void mem_free(void *p, int subsystem);
+static void mem_count(int subsystem, long bytes, long blocks);
+static __attribute__((unused)) long allocations_made();
+static void *arena_alloc(struct arena *a, long size);
+static void *arena_grow(struct arena *a, void *p, long old_size, long size);
+static int in_arena(struct arena *a, void *p);
+static void reset_arena(struct arena *a);
+static void free_arena(struct arena *a);
+static void report_heap(struct state_spec *state);
+static void yield_memory(struct state_spec *state);
+static long resident_kb();
+static void resize_intern_table(long num_buckets);
+static void add_char_to_string(struct string *str, char c, int realloc, int echo, int skip, struct string *lbuf);
+static void add_slice_to_string(struct string *str, char *text, long length, int reallocate, int echo, int skip, struct string *lbuf);
+static char get_flags(struct command_spec *command, struct state_spec *state);
+static void get_buffer_name(struct command_spec *command, struct state_spec *state);
+static int get_substitution(struct command_spec *command, struct state_spec *state);
+static int get_every(struct command_spec *command, struct state_spec *state);
+static int get_order(struct command_spec *command, struct state_spec *state);
+static int get_notation(struct command_spec *command, struct state_spec *state);
+static int get_string(struct string *str, char delim, int full, int unlimited, int literal, int oneline, struct string *oldline, struct state_spec *state);
+static struct string *get_lines(long *length, int literal, struct state_spec *state);
+static int set_tabs(char *stops, struct state_spec *state);
+static void print_tabs(struct state_spec *state);
+static long expand_tabs(char *dst, char *src, long length, unsigned char *tabs);
+static long line_column(struct string *str);
+static void start_loading(FILE *file, long line, struct state_spec *state);
+static void *load_lines(void *arg);
+static long split_chunk(char *chunk, long length, int eof, struct string *partial, struct string **lines, long *num_lines, long *space, int expand, unsigned char *tabs);
+static void adopt_lines(struct string *lines, long num_lines);
+static struct string *stream_lines(FILE *file, long *num_lines, struct state_spec *state);
+static void *read_stream(void *arg);
+static int filter_lines(char *shell_command, long first, long last, struct string **lines, long *num_lines, struct state_spec *state);
+static void absorb_lines(struct state_spec *state, int wait);
+static void finish_loading(struct state_spec *state);
+static void report_loading(struct state_spec *state);
+static struct command_spec* get_command(struct state_spec *state);
+static struct command_spec* parse_command(struct state_spec *state);
+static struct command_spec *new_command_spec();
+static long resolve_line_spec(struct line_spec *line, struct state_spec *state);
+static int execute_command(struct command_spec *command, struct state_spec *state);
+static struct line_spec *new_line_spec(char sign, char type, long line, struct string *search);
+static void free_command_spec(struct command_spec *cmd);
+static void free_buffer_stack(struct buffer_pos *stack);
+static void free_state_spec(struct state_spec *state);
+static char print_char(char c);
+static int print_buffer(char *buf);
+static void print_slice(char *text, long length);
+static void echo_text(const char *text);
+static void echo_char(char c);
+static __attribute__((unused)) void dump_state(struct state_spec *state);
+static __attribute__((unused)) struct state_spec* restore_state();
+static struct state_spec *new_state_spec();
+static __attribute__((unused)) int serve(char *path, struct state_spec *shared);
+static int read_request(struct client *client, struct state_spec *shared);
+static int serve_request(struct client *client, char *text, long length, struct state_spec *shared);
+static int run_commands(char *text, long length, FILE *out, struct state_spec *state);
+static int input_cut_off(struct state_spec *state);
+static void write_all(int fd, char *buf, long length);
+static void write_number(long n, FILE *f);
+static long read_number(FILE *f);
+#ifndef QED_NO_MAIN
+static struct termios original_term_settings;
+static void restore_terminal()
+/* Puts the terminal back the way qed found it. It is also run at exit, so that a fatal error doesn't leave the terminal in raw mode */
+{
+	if(isatty(fileno(stdin)))
+		fprintf(term_out, "\x1b[?2004l");
+	tcsetattr(fileno(stdin), TCSANOW, &original_term_settings);
+}
 int main(int argc, char **argv)
 {
 	struct command_spec *command;
@@ -141,21 +629,91 @@ int main(int argc, char **argv)
 	struct line_spec *ls;
 	int finished = 0;
 	int cont_flag = 0;
+	char *socket_path = NULL;
+	char *record_path = NULL;
+	char *replay_path = NULL;
+	term_in = stdin;
+	term_out = stdout;
 	for (int i=1; i<argc; i++)
 	{
 		if (!strcmp(argv[i], "-c"))
 		{
 			cont_flag = 1;
 		}
+		else if (!strcmp(argv[i], "-i"))
+		{
+			intern_lines = 1;
+		}
+		else if (!strcmp(argv[i], "-x"))
+		{
+			keep_indexes = 1;
+		}
+		else if (!strcmp(argv[i], "-p") && i+1 < argc)
+		{
+			pager.limit = atol(argv[++i]) << 20;
+		}
+		else if (!strcmp(argv[i], "-z") && i+1 < argc)
+		{
+			pager.limit = atol(argv[++i]) << 20;
+			pager.compress = 1;
+		}
+		else if (!strcmp(argv[i], "-s") && i+1 < argc)
+		{
+			socket_path = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-r") && i+1 < argc)
+		{
+			record_path = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-R") && i+1 < argc)
+		{
+			replay_path = argv[++i];
+		}
+		else if (!strcmp(argv[i], "-T"))
+		{
+			session.paced = 1;
+		}
+	}
+	session.start = microseconds();
+	if(record_path)
+	{
+		if(!(session.record = fopen(record_path, "w")))
+		{
+			fprintf(term_out, "I-O ERROR.\r\nCould not create session file at %s\r\n", record_path);
+			return 1;
+		}
+		fwrite("QEDK", 1, 4, session.record);
+	}
+	if(replay_path)
+	{
+		char sig[5] = {0};
+		if(!(session.replay = fopen(replay_path, "r")))
+		{
+			fprintf(term_out, "I-O ERROR.\r\nCould not read session file at %s\r\n", replay_path);
+			return 1;
+		}
+		if(fread(sig, 1, 4, session.replay) != 4 || strcmp(sig, "QEDK"))
+		{
+			fprintf(term_out, "Invalid signature in session file\r\n");
+			return 1;
+		}
+	}
+	if(socket_path)
+	{
+		state = cont_flag?restore_state():new_state_spec();
+		return state?serve(socket_path, state):1;
 	}
 	/* qed runs in terminal raw mode, so that characters typed by the user aren't echoed and so that we can do \r and \n separately when needed */
 	struct termios qed_term_settings;
-	struct termios original_term_settings;
 	tcgetattr(fileno(stdin), &original_term_settings);
 	qed_term_settings = original_term_settings;
 	cfmakeraw(&qed_term_settings);
 	tcsetattr(fileno(stdin), TCSANOW, &qed_term_settings);
+	atexit(restore_terminal);
 	setbuf(stdout,NULL);
+	/* Have the terminal bracket pasted text with ESC[200~ and ESC[201~ so that get_string can take it in whole */
+	if(isatty(fileno(stdin)))
+		fprintf(term_out, "\x1b[?2004h");
 
 	if(cont_flag)
 	{
@@ -164,125 +722,2019 @@ int main(int argc, char **argv)
 		{
 			return 1;
 		}
+		cmd_strings = state->quick?cmd_strings_quick:cmd_strings_verbose;
 	}
 	else
 	{
-		state = malloc(sizeof(struct state_spec));
-		state->main_buffer = calloc(sizeof(struct string), 1);
-		state->aux_buffers = calloc(sizeof(struct string), NUM_AUX_BUFS);
-		memset(state->aux_buffers, 0, sizeof(struct string) * NUM_AUX_BUFS);
-		state->dollar = 0;
-		state->dot = 0;
-		state->file = NULL;
-		state->quick = 0;
-		state->wrote_out = 1;
-		state->buffer_stack = NULL;
+		state = new_state_spec();
 	}
+	/* Take the parser arena's first block now, so that reading commands makes no allocations at all, as a replay reports */
+	arena_alloc(&parser_arena, 0);
+	reset_arena(&parser_arena);
 	do
 	{
+		/* The keys of a recording are flushed a command at a time, rather than a write per key, which a big paste would make thousands of */
+		if(session.record)
+			fflush(session.record);
+		report_loading(state);
+		long made = allocations_made();
 		command = get_command(state);
 		if(command != NULL)
 		{
+			long parse_made = allocations_made() - made;
+			long started = microseconds();
 			finished = execute_command(command, state);
 			free_command_spec(command);
+			if(session.replay)
+			{
+				long took = microseconds() - started;
+				session.commands++;
+				session.command_time += took;
+				if(took > session.slowest)
+					session.slowest = took;
+				session.allocations += allocations_made() - made;
+				session.parse_allocations += parse_made;
+			}
 		}
 		else
 		{
 			err(state);
-			printf("\r\n");
+			fprintf(term_out, "\r\n");
 		}
 	} while(!finished);
+	report_loading(state);
+	if(session.replay)
+		report_replay();
+	if(session.record)
+		fclose(session.record);
 	if (!state->wrote_out) {
-		printf("WRITE OUT!\r\n");
+		fprintf(term_out, "WRITE OUT!\r\n");
 	}
 
 	dump_state(state);
 	free_state_spec(state);
-	tcsetattr(fileno(stdin), TCSANOW, &original_term_settings);
 	return 0;
 }
+#endif
 
 void err(struct state_spec *state)
 /* Called when there's any kind of error in a command. Prints out "?" and clears the stack of buffer execution. The manual suggests using the latter behavior as a form of flow control */
 {
-	printf("?\r\n");
+	fprintf(term_out, "?\r\n");
+	state->errors++;
 	free_buffer_stack(state->buffer_stack);
 	state->buffer_stack = NULL;
 }
-int buffer_for_char(char c)
-/* Converts from a buffer name (one alphanumeric character) to the buffer number, indicating where in our array of buffers that buffer is stored */
+int buffer_for_char(char c)
+/* Converts from a buffer name (one alphanumeric character) to the buffer number, indicating where in our array of buffers that buffer is stored */
+{
+	if(isdigit(c))
+		return (int)c-'0';
+	else if(isalpha(c))
+		return c-'A'+10;
+	else
+		return -1;
+}
+void kill_buffer(int buffer_num, struct state_spec *state)
+/* Executes the KILL buffer command, clearing the contents of the given-numbered buffer */
+{
+	struct span_list *spans = &state->aux_spans[buffer_num];
+	delete_string(&state->aux_buffers[buffer_num]);
+	for(long i = 0; i < spans->num_lines; i++)
+	{
+		delete_string(&spans->lines[i]);
+	}
+	mem_free(spans->lines, MEM_LINES);
+	spans->lines = NULL;
+	spans->num_lines = 0;
+}
+void set_buffer(int buffer_num, struct string *new_text, struct state_spec *state)
+/* Sets the contents of the given-numbered buffer to the given text, such as by the JAM INTO command */
+{
+	kill_buffer(buffer_num, state);
+	copy_string(&state->aux_buffers[buffer_num], new_text, 0);
+}
+void set_buffer_lines(int buffer_num, struct string *lines, long num_lines, struct state_spec *state)
+/* Sets the contents of the given-numbered buffer to the given lines, as LOAD and GET do. The buffer takes ownership of lines, which should share their text with the main buffer */
+{
+	kill_buffer(buffer_num, state);
+	state->aux_spans[buffer_num].lines = lines;
+	state->aux_spans[buffer_num].num_lines = num_lines;
+}
+struct string *aux_buffer(int buffer_num, struct state_spec *state)
+/* Returns the string holding the contents of the given-numbered buffer. If the buffer was filled with lines by LOAD or GET, they are joined into the string first */
+{
+	struct span_list *spans = &state->aux_spans[buffer_num];
+	if(spans->lines)
+	{
+		struct string *buffer = &state->aux_buffers[buffer_num];
+		long buffer_length = 0;
+		for(long i = 0; i < spans->num_lines; i++)
+		{
+			buffer_length += spans->lines[i].length;
+		}
+		delete_string(buffer);
+		string_with_capacity(buffer, buffer_length);
+		for(long i = 0; i < spans->num_lines; i++)
+		{
+			memcpy(buffer->buf+buffer->length, spans->lines[i].buf, spans->lines[i].length);
+			buffer->length += spans->lines[i].length;
+			buffer->buf[buffer->length-1] = '\r';
+			delete_string(&spans->lines[i]);
+		}
+		buffer->buf[buffer->length] = '\0';
+		mem_free(spans->lines, MEM_LINES);
+		spans->lines = NULL;
+		spans->num_lines = 0;
+	}
+	return &state->aux_buffers[buffer_num];
+}
+struct string *buffer_lines(int buffer_num, long *num_lines, struct state_spec *state)
+/* Splits the contents of the given-numbered buffer into lines ready to be put in the main buffer, as UNLOAD does. Lines LOADed into the buffer are shared rather than copied; otherwise the text is split at its \r separators. The number of lines is stored in num_lines and the array of lines returned, to be freed by the caller */
+{
+	struct span_list *spans = &state->aux_spans[buffer_num];
+	struct string *buffer = &state->aux_buffers[buffer_num];
+	if(spans->lines)
+	{
+		struct string *lines = mem_calloc(sizeof(struct string), spans->num_lines, MEM_LINES);
+		for(long i = 0; i < spans->num_lines; i++)
+		{
+			share_string(&lines[i], &spans->lines[i]);
+		}
+		*num_lines = spans->num_lines;
+		return lines;
+	}
+	return split_lines(buffer->buf, buffer->length, '\r', num_lines);
+}
+struct string *split_lines(char *text, long length, char separator, long *num_lines)
+/* Splits the first length characters of text into lines ready to be put in the main buffer, ending each in \n in place of the separator. A last line without a separator is kept as if it had one. The number of lines is stored in num_lines and the array of lines returned, to be freed by the caller */
+{
+	struct string *lines;
+	char *text_end = text + length;
+	*num_lines = 0;
+	for(char *p = text; p && p < text_end; p++)
+	{
+		if((p = memchr(p, separator, text_end - p)))
+			(*num_lines)++;
+		else
+			break;
+	}
+	if(length && text[length-1] != separator)
+		(*num_lines)++;
+	lines = mem_alloc(sizeof(struct string) * *num_lines, MEM_LINES);
+	char *start = text;
+	for(long i = 0; i < *num_lines; i++)
+	{
+		char *end = memchr(start, separator, text_end - start);
+		long line_length = end?end-start:text_end - start;
+		string_with_capacity(&lines[i], line_length+1);
+		memcpy(lines[i].buf, start, line_length);
+		lines[i].buf[line_length] = '\n';
+		lines[i].buf[line_length+1] = '\0';
+		lines[i].length = line_length+1;
+		intern_string(&lines[i]);
+		start += line_length+1;
+	}
+	return lines;
+}
+struct string *get_line(long line, struct state_spec *state)
+/* Returns the given line of the main buffer, reading its text back from the swap file first if it has been paged out. The text is only guaranteed to stay in memory until the next call; hold on to it with share_string if it's needed for longer */
+{
+	struct string *s = &state->main_buffer[line];
+	if(!pager.limit)
+		return s;
+	if(line/PAGE_LINES >= pager.num_pages)
+	{
+		long num_pages = line/PAGE_LINES + 1;
+		pager.used = mem_realloc(pager.used, num_pages, MEM_PAGER);
+		memset(pager.used + pager.num_pages, 0, num_pages - pager.num_pages);
+		pager.num_pages = num_pages;
+	}
+	pager.used[line/PAGE_LINES] = 1;
+	if(s->space == SWAPPED)
+	{
+		make_room(state);
+		page_in(line, state);
+	}
+	return s;
+}
+void page_in(long line, struct state_spec *state)
+/* Reads the text of the given paged-out line back from the swap file, along with that of the lines around it that were written out next to it, up to READ_AHEAD bytes or the ends of its page */
+{
+	long start = state->main_buffer[line].swap_offset;
+	long end = start + state->main_buffer[line].length;
+	long first = line, last = line;
+	while(last < state->dollar && last+1 < (line/PAGE_LINES+1)*PAGE_LINES && end - start < READ_AHEAD)
+	{
+		struct string *next = &state->main_buffer[last+1];
+		if(next->space != SWAPPED || next->swap_offset != end)
+			break;
+		end += next->length;
+		last++;
+	}
+	/* Backward searches go through the page the other way, so read back toward its start too with whatever is left of READ_AHEAD */
+	while(first > 1 && first-1 >= line/PAGE_LINES*PAGE_LINES && end - start < READ_AHEAD)
+	{
+		struct string *prev = &state->main_buffer[first-1];
+		if(prev->space != SWAPPED || prev->swap_offset + prev->length != start)
+			break;
+		start -= prev->length;
+		first--;
+	}
+	char *text = mem_alloc(end - start, MEM_PAGER);
+	swap_read(text, end - start, start);
+	for(long i = first; i <= last; i++)
+	{
+		struct string *s = &state->main_buffer[i];
+		long offset = s->swap_offset;
+		intern_slice(s, text + offset - start, s->length);
+		if(text_header(s->buf)->swap_offset < 0)
+			text_header(s->buf)->swap_offset = offset;
+		swap_ref(offset, -1);
+	}
+	mem_free(text, MEM_PAGER);
+}
+int page_out_lines(struct string *lines, long first, long last)
+/* Pages out lines first through last of the given array, writing any text that isn't already in the swap space to the end of it in one go, and turning each line into a SWAPPED string.
+   If the write fails the lines stay in memory as they were, pager.failed is set, and -1 is returned */
+{
+	long size = 0;
+	for(long i = first; i <= last; i++)
+	{
+		if(lines[i].space == SHARED && !swap_live(text_header(lines[i].buf)->swap_offset))
+			size += lines[i].length;
+	}
+	char *out = mem_alloc(size+1, MEM_PAGER);
+	long start = pager.swap_end;
+	long pos = 0;
+	long new_refs = 0;
+	for(long i = first; i <= last; i++)
+	{
+		struct string *s = &lines[i];
+		if(s->space != SHARED)
+			continue;
+		struct line_text *t = text_header(s->buf);
+		/* Interned lines can share a text, which then only gets written once; so pos, not size, is how much ends up written */
+		if(t->swap_offset < start && !swap_live(t->swap_offset))
+		{
+			memcpy(out + pos, s->buf, s->length);
+			t->swap_offset = start + pos;
+			pos += s->length;
+		}
+	}
+	if(swap_write(out, pos))
+	{
+		/* Forget the offsets handed out for the write, so that the texts are written again next time */
+		for(long i = first; i <= last; i++)
+		{
+			if(lines[i].space == SHARED && text_header(lines[i].buf)->swap_offset >= start)
+				text_header(lines[i].buf)->swap_offset = -1;
+		}
+		mem_free(out, MEM_PAGER);
+		pager.failed = 1;
+		return -1;
+	}
+	for(long i = first; i <= last; i++)
+	{
+		struct string *s = &lines[i];
+		if(s->space != SHARED)
+			continue;
+		long offset = text_header(s->buf)->swap_offset;
+		if(offset < start)
+			swap_ref(offset, 1);
+		else
+			new_refs++;
+		release_text(s->buf);
+		s->swap_offset = offset;
+		s->space = SWAPPED;
+	}
+	if(new_refs)
+		swap_ref(start, new_refs);
+	mem_free(out, MEM_PAGER);
+	return 0;
+}
+void make_room(struct state_spec *state)
+/* If more line text is in memory than the paging limit allows, pages out pages of the main buffer until it isn't. Pages are considered in turn by a clock hand; one that has been looked at since the hand last passed it gets a second chance */
+{
+	long num_pages = state->dollar/PAGE_LINES + 1;
+	if(!pager.limit || pager.resident <= pager.limit)
+		return;
+	if(num_pages > pager.num_pages)
+	{
+		pager.used = mem_realloc(pager.used, num_pages, MEM_PAGER);
+		memset(pager.used + pager.num_pages, 0, num_pages - pager.num_pages);
+		pager.num_pages = num_pages;
+	}
+	for(long n = 0; n < 2*num_pages && pager.resident > pager.limit; n++)
+	{
+		if(pager.hand >= num_pages)
+			pager.hand = 0;
+		if(pager.used[pager.hand])
+			pager.used[pager.hand] = 0;
+		else
+		{
+			long first = pager.hand*PAGE_LINES, last = first+PAGE_LINES-1;
+			if(page_out_lines(state->main_buffer, first?first:1, last < state->dollar?last:state->dollar))
+				return;
+		}
+		pager.hand++;
+	}
+}
+void swap_read(char *dst, long length, long offset)
+/* Reads length bytes of the swap space, starting at offset, into dst */
+{
+	if(!pager.compress)
+	{
+		/* Text that can't be read back is lost, so there is nothing for it but to give up */
+		if(pread(fileno(pager.swap), dst, length, offset) != length)
+		{
+			fprintf(term_out, "I-O ERROR.\r\n");
+			exit(1);
+		}
+		return;
+	}
+	for(int page = find_packed_page(offset); length > 0; page++)
+	{
+		struct packed_page *p = &pager.packed[page];
+		long skip = offset - p->start;
+		long n = p->length - skip < length ? p->length - skip : length;
+		memcpy(dst, unpack_page(page) + skip, n);
+		dst += n;
+		offset += n;
+		length -= n;
+	}
+}
+int swap_write(char *src, long length)
+/* Adds length bytes from src to the end of the swap space. Returns -1 if they couldn't be written */
+{
+	if(!length)
+		return 0;
+	if(pager.compress)
+	{
+		if(pager.num_packed == pager.packed_space)
+		{
+			pager.packed_space = pager.packed_space ? 2*pager.packed_space : 64;
+			pager.packed = mem_realloc(pager.packed, pager.packed_space*sizeof(struct packed_page), MEM_PAGER);
+		}
+		struct packed_page *p = &pager.packed[pager.num_packed++];
+		char *packed = mem_alloc(length + length/255 + 16, MEM_PAGER);
+		p->start = pager.swap_end;
+		p->length = length;
+		p->packed_length = lz_compress(src, length, packed);
+		p->data = mem_alloc(p->packed_length, MEM_PAGER);
+		memcpy(p->data, packed, p->packed_length);
+		mem_free(packed, MEM_PAGER);
+		p->refs = 0;
+	}
+	else if((!pager.swap && !(pager.swap = tmpfile())) || pwrite(fileno(pager.swap), src, length, pager.swap_end) != length)
+		return -1;
+	pager.swap_end += length;
+	return 0;
+}
+int swap_live(long offset)
+/* Tells whether the text written to the swap space at offset can still be read back. In compressed mode a page is dropped once no line refers to it, after which its text has to be written again */
+{
+	if(offset < 0)
+		return 0;
+	if(!pager.compress)
+		return 1;
+	return pager.packed[find_packed_page(offset)].data != NULL;
+}
+void swap_ref(long offset, long delta)
+/* In compressed mode, adds delta to the count of SWAPPED strings referring to the page holding offset, dropping the page when that reaches 0 */
+{
+	if(!pager.compress)
+		return;
+	int page = find_packed_page(offset);
+	struct packed_page *p = &pager.packed[page];
+	p->refs += delta;
+	if(p->refs > 0)
+		return;
+	mem_free(p->data, MEM_PAGER);
+	p->data = NULL;
+	for(int i = 0; i < PACK_CACHE; i++)
+	{
+		if(pager.cache && pager.cache[i].page == page)
+		{
+			mem_free(pager.cache[i].text, MEM_PAGER);
+			pager.cache[i].text = NULL;
+			pager.cache[i].page = -1;
+		}
+	}
+}
+int find_packed_page(long offset)
+/* Returns the index of the packed page holding the given offset of the swap space */
+{
+	int low = 0, high = pager.num_packed - 1;
+	while(low < high)
+	{
+		int mid = (low + high + 1)/2;
+		if(pager.packed[mid].start <= offset)
+			low = mid;
+		else
+			high = mid - 1;
+	}
+	return low;
+}
+char *unpack_page(int page)
+/* Returns the text of the given packed page, unpacking it if it isn't in the cache. On a miss the live pages after it are unpacked too, one per processor
+   in parallel, since a search or a PRINT of a range will want them next. The text stays valid until the next call */
+{
+	if(!pager.cache)
+	{
+		pager.cache = mem_alloc(PACK_CACHE*sizeof(struct unpacked_page), MEM_PAGER);
+		for(int i = 0; i < PACK_CACHE; i++)
+		{
+			pager.cache[i].page = -1;
+			pager.cache[i].text = NULL;
+		}
+	}
+	for(int i = 0; i < PACK_CACHE; i++)
+	{
+		if(pager.cache[i].page == page)
+			return pager.cache[i].text;
+	}
+	int num_jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_jobs > PACK_CACHE/2)
+		num_jobs = PACK_CACHE/2;
+	if(num_jobs < 1)
+		num_jobs = 1;
+	struct unpacked_page *jobs[num_jobs];
+	pthread_t threads[num_jobs];
+	int started[num_jobs];
+	int n = 0;
+	for(int next = page; n < num_jobs && next < pager.num_packed; next++)
+	{
+		int cached = 0;
+		for(int i = 0; i < PACK_CACHE; i++)
+			cached |= pager.cache[i].page == next;
+		if(!pager.packed[next].data || cached)
+			continue;
+		/* Each job's slot is emptied before the threads start, so that none of them can be freeing text another is still using */
+		struct unpacked_page *slot = &pager.cache[pager.cache_hand];
+		pager.cache_hand = (pager.cache_hand + 1) % PACK_CACHE;
+		mem_free(slot->text, MEM_PAGER);
+		slot->text = NULL;
+		slot->page = next;
+		jobs[n++] = slot;
+	}
+	for(int i = 1; i < n; i++)
+		started[i] = !pthread_create(&threads[i], NULL, unpack_job, jobs[i]);
+	unpack_job(jobs[0]);
+	for(int i = 1; i < n; i++)
+	{
+		if(started[i])
+			pthread_join(threads[i], NULL);
+		else
+			unpack_job(jobs[i]);
+	}
+	return jobs[0]->text;
+}
+void *unpack_job(void *arg)
+/* Unpacks the page an unpacked_page slot has been given into a new text for the slot. Run on its own thread by unpack_page */
+{
+	struct unpacked_page *slot = arg;
+	struct packed_page *p = &pager.packed[slot->page];
+	slot->text = mem_alloc(p->length, MEM_PAGER);
+	lz_decompress(p->data, p->packed_length, slot->text);
+	return NULL;
+}
+long lz_compress(char *src, long length, char *dst)
+/* Packs length bytes of src into dst, which must have room for length + length/255 + 16 bytes, and returns the packed length. The packed form is
+   a series of sequences, each made of a token byte whose high 4 bits count literal bytes and whose low 4 bits give the length of a match minus 4,
+   with 15 in either meaning that more of the count follows in bytes added on until one is less than 255; then the literal bytes; then the 2-byte
+   distance back to where the match is copied from, and the rest of the match length. The last sequence stops after its literals */
+{
+	unsigned char *in = (unsigned char *)src;
+	long table[4096];
+	long pos = 0, anchor = 0, out = 0;
+	memset(table, -1, sizeof(table));
+	while(pos + 4 <= length)
+	{
+		unsigned int word;
+		memcpy(&word, in + pos, 4);
+		unsigned int h = (word * 2654435761u) >> 20;
+		long candidate = table[h];
+		table[h] = pos;
+		if(candidate < 0 || pos - candidate > 65535 || memcmp(in + candidate, in + pos, 4))
+		{
+			pos++;
+			continue;
+		}
+		long match = 4;
+		while(pos + match < length && in[candidate + match] == in[pos + match])
+			match++;
+		out = lz_sequence((unsigned char *)dst, out, in + anchor, pos - anchor, pos - candidate, match);
+		pos += match;
+		anchor = pos;
+	}
+	return lz_sequence((unsigned char *)dst, out, in + anchor, length - anchor, 0, 0);
+}
+long lz_sequence(unsigned char *dst, long pos, unsigned char *literals, long num_literals, int offset, long match)
+/* Writes one sequence of the form described at lz_compress to dst at pos, with no match if match is 0, and returns the position after it */
+{
+	long extra = match ? match - 4 : 0;
+	long token = pos++;
+	dst[token] = (num_literals < 15 ? num_literals : 15) << 4 | (extra < 15 ? extra : 15);
+	if(num_literals >= 15)
+	{
+		long n;
+		for(n = num_literals - 15; n >= 255; n -= 255)
+			dst[pos++] = 255;
+		dst[pos++] = n;
+	}
+	memcpy(dst + pos, literals, num_literals);
+	pos += num_literals;
+	if(match)
+	{
+		dst[pos++] = offset & 0xFF;
+		dst[pos++] = offset >> 8;
+		if(extra >= 15)
+		{
+			long n;
+			for(n = extra - 15; n >= 255; n -= 255)
+				dst[pos++] = 255;
+			dst[pos++] = n;
+		}
+	}
+	return pos;
+}
+long lz_decompress(char *src, long length, char *dst)
+/* Unpacks length bytes packed by lz_compress from src into dst, and returns the unpacked length */
+{
+	unsigned char *in = (unsigned char *)src;
+	long pos = 0, out = 0;
+	while(pos < length)
+	{
+		int token = in[pos++];
+		long n = token >> 4;
+		if(n == 15)
+		{
+			int c;
+			do
+				n += c = in[pos++];
+			while(c == 255);
+		}
+		memcpy(dst + out, in + pos, n);
+		pos += n;
+		out += n;
+		if(pos >= length)
+			break;
+		int offset = in[pos] | in[pos+1] << 8;
+		pos += 2;
+		long match = token & 15;
+		if(match == 15)
+		{
+			int c;
+			do
+				match += c = in[pos++];
+			while(c == 255);
+		}
+		match += 4;
+		/* Copied a byte at a time, since a match can overlap the text it produces */
+		for(long i = 0; i < match; i++)
+			dst[out+i] = dst[out-offset+i];
+		out += match;
+	}
+	return out;
+}
+long find_string(struct string *search, long start_line, int is_tag, int backward, struct state_spec *state)
+/* Implements the behavior of searches [] and tag searches :: by searching for the given string in the main buffer, starting from the given line and wrapping.
+   If backward is set, as for searches ??, the search goes toward line 1 instead, wrapping around from $. Returns 0 if no line matches */
+{
+	long i;
+	struct search_result *result = cached_search(search, is_tag, state);
+	/* With an index, working out all the matches costs little more than finding the first */
+	if(result->generation != edit_generation && (result->last_used || ready_index(state)))
+		find_matches(result, state);
+	if(result->generation == edit_generation)
+	{
+		if(!result->num_matches)
+			return 0;
+		if(backward)
+		{
+			i = first_match_from(result, (start_line < state->dollar?start_line:state->dollar) + 1);
+			return result->matches[i?i-1:result->num_matches-1];
+		}
+		i = first_match_from(result, start_line);
+		return result->matches[i < result->num_matches?i:0];
+	}
+	if(backward)
+	{
+		for(i = start_line < state->dollar?start_line:state->dollar; i >= 1; i--)
+		{
+			if(line_matches(get_line(i, state)->buf, result))
+				return i;
+		}
+		for(i = state->dollar; i > start_line && i >= 1; i--)
+		{
+			if(line_matches(get_line(i, state)->buf, result))
+				return i;
+		}
+		return 0;
+	}
+	for(i = start_line; i <= state->dollar; i++)
+	{
+		if(line_matches(get_line(i, state)->buf, result))
+			return i;
+	}
+	for(i = 1; i < start_line; i++)
+	{
+		if(line_matches(get_line(i, state)->buf, result))
+			return i;
+	}
+	return 0;
+}
+int line_matches(char *text, struct search_result *result)
+/* Tells whether the line text contains the search string of a cached search, or for a tag search, starts with it as a whole word */
+{
+	if(result->patterns)
+		return result->pattern && pattern_search(result->pattern, text);
+	char *found = strstr(text, result->search.buf);
+	if(result->is_tag)
+	{
+		char next = found?found[result->search.length]:'0';
+		return found == text && next && !isalnum(next);
+	}
+	return found != NULL;
+}
+struct search_result *cached_search(struct string *search, int is_tag, struct state_spec *state)
+/* Returns the state's cached matches for the given search, making room for them in place of the least recently used search if it isn't cached.
+   A search seen for the first time gets a last_used of 0, so that its matches aren't worked out until it is used again */
+{
+	struct search_result *oldest = NULL;
+	if(!state->searches)
+	{
+		state->searches = mem_calloc(sizeof(struct search_result), SEARCH_CACHE, MEM_OTHER);
+		for(int i = 0; i < SEARCH_CACHE; i++)
+			state->searches[i].generation = -1;
+	}
+	search_clock++;
+	for(int i = 0; i < SEARCH_CACHE; i++)
+	{
+		struct search_result *result = &state->searches[i];
+		if(result->search.buf && result->is_tag == is_tag && result->patterns == state->patterns && result->search.length == search->length && !memcmp(result->search.buf, search->buf, search->length))
+		{
+			result->last_used = search_clock;
+			return result;
+		}
+		if(!oldest || result->last_used < oldest->last_used)
+			oldest = result;
+	}
+	copy_string(&oldest->search, search, 0);
+	oldest->is_tag = is_tag;
+	oldest->patterns = state->patterns;
+	free_pattern(oldest->pattern);
+	oldest->pattern = state->patterns?new_pattern(search, is_tag):NULL;
+	oldest->generation = -1;
+	oldest->num_matches = 0;
+	oldest->last_used = 0;
+	return oldest;
+}
+void find_matches(struct search_result *result, struct state_spec *state)
+/* Works out which lines of the main buffer match a cached search, only looking at the lines the index has the search in if there is one */
+{
+	struct line_index *index = result->patterns?NULL:ready_index(state);
+	result->num_matches = 0;
+	if(!index || !index_matches(index, result, state))
+	{
+		for(long i = 1; i <= state->dollar; i++)
+		{
+			if(line_matches(get_line(i, state)->buf, result))
+				add_match(result, i);
+		}
+	}
+	result->generation = edit_generation;
+}
+void add_match(struct search_result *result, long line)
+/* Adds a line to the end of a cached search's matches */
+{
+	if(result->num_matches == result->space)
+	{
+		result->space = result->space?result->space*2:64;
+		result->matches = mem_realloc(result->matches, result->space * sizeof(long), MEM_OTHER);
+	}
+	result->matches[result->num_matches++] = line;
+}
+long first_match_from(struct search_result *result, long line)
+/* Returns the index of the first of a cached search's matches that is at or after the given line, or num_matches if there isn't one */
+{
+	long low = 0, high = result->num_matches;
+	while(low < high)
+	{
+		long mid = (low + high)/2;
+		if(result->matches[mid] < line)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+struct pattern *new_pattern(struct string *text, int is_tag)
+/* Compiles a search or SUBSTITUTE string typed with NOTATION PATTERNS on. A pattern is a run of items: a byte, . for any byte but the
+   end of the line, or a class in brackets such as [a-z_] or [^0-9], any of which * after it lets repeat. ^ at the start and $ at the end
+   tie it to the start and end of the line, and \ makes the byte after it stand for itself. A tag search has to be followed by a byte that
+   isn't a letter or digit, as for a literal tag. Returns NULL if a class isn't finished */
+{
+	struct pattern *pattern = mem_calloc(1, sizeof(struct pattern), MEM_OTHER);
+	struct pattern_item *items = pattern->items = mem_calloc(text->length + 1, sizeof(struct pattern_item), MEM_OTHER);
+	char *p = text->buf, *end = text->buf + text->length;
+	int n = 0;
+	if(p < end && *p == '^')
+	{
+		pattern->anchored = 1;
+		p++;
+	}
+	while(p < end)
+	{
+		if(*p == '*' && n)
+		{
+			items[n-1].repeat = 1;
+			p++;
+			continue;
+		}
+		struct pattern_item *item = &items[n++];
+		if(*p == '$' && p + 1 == end)
+		{
+			item->bytes['\n' / 8] |= 1 << ('\n' % 8);
+			pattern->at_end = 1;
+			p++;
+		}
+		else if(*p == '.')
+		{
+			memset(item->bytes, 0xFF, 32);
+			item->bytes['\n' / 8] &= ~(1 << ('\n' % 8));
+			p++;
+		}
+		else if(*p == '[')
+		{
+			if(!(p = get_class(p + 1, end, item)))
+			{
+				free_pattern(pattern);
+				return NULL;
+			}
+		}
+		else
+		{
+			if(*p == '\\' && p + 1 < end)
+				p++;
+			unsigned char byte = *p++;
+			item->bytes[byte / 8] |= 1 << (byte % 8);
+		}
+	}
+	if(is_tag)
+	{
+		struct pattern_item *item = &items[n++];
+		for(int c = 1; c < 256; c++)
+		{
+			if(!isalnum(c))
+				item->bytes[c / 8] |= 1 << (c % 8);
+		}
+		pattern->anchored = 1;
+	}
+	pattern->num_items = n;
+	pattern->reversed = mem_alloc((n?n:1) * sizeof(struct pattern_item), MEM_OTHER);
+	for(int i = 0; i < n; i++)
+		pattern->reversed[i] = items[n - 1 - i];
+	init_dfa(&pattern->search, items, n, !pattern->anchored);
+	init_dfa(&pattern->longest, items, n, 0);
+	init_dfa(&pattern->starts, pattern->reversed, n, 1);
+	return pattern;
+}
+char *get_class(char *p, char *end, struct pattern_item *item)
+/* Reads a class such as [a-z_] or [^0-9], starting just after its [, into item. A ] right after the [ or [^ is one of the bytes rather than the end,
+   and a negated class never matches the end of the line. Returns where the class ends, or NULL if it doesn't */
+{
+	int negate = 0;
+	if(p < end && *p == '^')
+	{
+		negate = 1;
+		p++;
+	}
+	char *first = p;
+	while(p < end && (*p != ']' || p == first))
+	{
+		if(*p == '\\' && p + 1 < end)
+			p++;
+		unsigned char low = *p++, high = low;
+		if(p + 1 < end && *p == '-' && p[1] != ']')
+		{
+			p++;
+			if(*p == '\\' && p + 1 < end)
+				p++;
+			high = *p++;
+		}
+		for(int c = low; c <= high; c++)
+			item->bytes[c / 8] |= 1 << (c % 8);
+	}
+	if(p >= end)
+		return NULL;
+	if(negate)
+	{
+		for(int i = 0; i < 32; i++)
+			item->bytes[i] = ~item->bytes[i];
+		item->bytes['\n' / 8] &= ~(1 << ('\n' % 8));
+	}
+	return p + 1;
+}
+int pattern_open(struct string *pattern)
+/* Tells whether a ] typed after the pattern so far would be part of it, in or closing a class or following a \, rather than the end of a [] search */
+{
+	int in_class = 0;
+	long class_start = 0;
+	for(long i = 0; i < pattern->length; i++)
+	{
+		char c = pattern->buf[i];
+		if(c == '\\')
+		{
+			if(++i == pattern->length)
+				return 1;
+		}
+		else if(!in_class && c == '[')
+		{
+			in_class = 1;
+			class_start = i + 1 + (i + 1 < pattern->length && pattern->buf[i+1] == '^');
+		}
+		else if(in_class && c == ']' && i > class_start)
+			in_class = 0;
+	}
+	return in_class;
+}
+void free_pattern(struct pattern *pattern)
+{
+	if(!pattern)
+		return;
+	free_dfa(&pattern->search);
+	free_dfa(&pattern->longest);
+	free_dfa(&pattern->starts);
+	mem_free(pattern->items, MEM_OTHER);
+	mem_free(pattern->reversed, MEM_OTHER);
+	mem_free(pattern->begins, MEM_OTHER);
+	mem_free(pattern, MEM_OTHER);
+}
+void init_dfa(struct dfa *dfa, struct pattern_item *items, int num_items, int unanchored)
+/* Sets up a DFA for the given items with just its dead and start states. This is also how it is started again once it gets too big */
+{
+	if(items)
+	{
+		memset(dfa, 0, sizeof(struct dfa));
+		dfa->items = items;
+		dfa->num_items = num_items;
+		dfa->unanchored = unanchored;
+		dfa->words = num_items / (8 * sizeof(unsigned long)) + 1;
+		dfa->scratch = mem_alloc(dfa->words * sizeof(unsigned long), MEM_OTHER);
+	}
+	else
+		dfa->restarts++;
+	dfa->num_states = 0;
+	if(dfa->buckets)
+		memset(dfa->buckets, 0xFF, 2 * dfa->space * sizeof(int));
+	memset(dfa->scratch, 0, dfa->words * sizeof(unsigned long));
+	dfa_state(dfa, dfa->scratch);
+	dfa->scratch[0] = 1;
+	close_set(dfa, dfa->scratch);
+	dfa_state(dfa, dfa->scratch);
+}
+int dfa_state(struct dfa *dfa, unsigned long *set)
+/* Returns the number of the DFA's state for the given set, making a new state if there isn't one. The DFA is started again first if it is full */
+{
+	unsigned long hash = 0;
+	int words = dfa->words;
+	for(int i = 0; i < words; i++)
+		hash = (hash ^ set[i]) * 0x100000001B3UL;
+	hash ^= hash >> 29;
+	if(dfa->space)
+	{
+		for(unsigned long b = hash & (2 * dfa->space - 1); dfa->buckets[b] >= 0; b = (b + 1) & (2 * dfa->space - 1))
+		{
+			if(!memcmp(dfa->sets + dfa->buckets[b] * words, set, words * sizeof(unsigned long)))
+				return dfa->buckets[b];
+		}
+	}
+	if(dfa->num_states == MAX_DFA_STATES)
+	{
+		/* Keep the set; starting again reuses the scratch space */
+		unsigned long saved[words];
+		memcpy(saved, set, words * sizeof(unsigned long));
+		init_dfa(dfa, NULL, 0, 0);
+		return dfa_state(dfa, saved);
+	}
+	if(dfa->num_states == dfa->space)
+	{
+		dfa->space = dfa->space?dfa->space * 2:16;
+		dfa->sets = mem_realloc(dfa->sets, dfa->space * words * sizeof(unsigned long), MEM_OTHER);
+		dfa->accepts = mem_realloc(dfa->accepts, dfa->space, MEM_OTHER);
+		dfa->next = mem_realloc(dfa->next, dfa->space * 256 * sizeof(int), MEM_OTHER);
+		mem_free(dfa->buckets, MEM_OTHER);
+		dfa->buckets = mem_alloc(2 * dfa->space * sizeof(int), MEM_OTHER);
+		memset(dfa->buckets, 0xFF, 2 * dfa->space * sizeof(int));
+		for(int i = 0; i < dfa->num_states; i++)
+		{
+			unsigned long h = 0;
+			for(int j = 0; j < words; j++)
+				h = (h ^ dfa->sets[i * words + j]) * 0x100000001B3UL;
+			h ^= h >> 29;
+			unsigned long b = h & (2 * dfa->space - 1);
+			while(dfa->buckets[b] >= 0)
+				b = (b + 1) & (2 * dfa->space - 1);
+			dfa->buckets[b] = i;
+		}
+	}
+	int state = dfa->num_states++;
+	memcpy(dfa->sets + state * words, set, words * sizeof(unsigned long));
+	dfa->accepts[state] = (set[dfa->num_items / (8 * sizeof(unsigned long))] >> (dfa->num_items % (8 * sizeof(unsigned long)))) & 1;
+	memset(dfa->next + state * 256, 0xFF, 256 * sizeof(int));
+	unsigned long b = hash & (2 * dfa->space - 1);
+	while(dfa->buckets[b] >= 0)
+		b = (b + 1) & (2 * dfa->space - 1);
+	dfa->buckets[b] = state;
+	return state;
+}
+int dfa_step(struct dfa *dfa, int state, unsigned char byte)
+/* Returns the state the DFA goes to from state on reading byte, working it out if this is the first time */
+{
+	int next = dfa->next[state * 256 + byte];
+	if(next >= 0)
+		return next;
+	const int bits = 8 * sizeof(unsigned long);
+	unsigned long *from = dfa->sets + state * dfa->words, *set = dfa->scratch;
+	memset(set, 0, dfa->words * sizeof(unsigned long));
+	for(int i = 0; i < dfa->num_items; i++)
+	{
+		if(!((from[i / bits] >> (i % bits)) & 1) || !((dfa->items[i].bytes[byte / 8] >> (byte % 8)) & 1))
+			continue;
+		set[(i + 1) / bits] |= 1UL << ((i + 1) % bits);
+		if(dfa->items[i].repeat)
+			set[i / bits] |= 1UL << (i % bits);
+	}
+	if(dfa->unanchored)
+		set[0] |= 1;
+	close_set(dfa, set);
+	long restarts = dfa->restarts;
+	next = dfa_state(dfa, set);
+	if(restarts == dfa->restarts)
+		dfa->next[state * 256 + byte] = next;
+	return next;
+}
+void close_set(struct dfa *dfa, unsigned long *set)
+/* Adds to a DFA state's set the items that could have been matched by skipping repeated items, which match nothing as well as something */
+{
+	const int bits = 8 * sizeof(unsigned long);
+	for(int i = 0; i < dfa->num_items; i++)
+	{
+		if(dfa->items[i].repeat && ((set[i / bits] >> (i % bits)) & 1))
+			set[(i + 1) / bits] |= 1UL << ((i + 1) % bits);
+	}
+}
+void free_dfa(struct dfa *dfa)
+{
+	mem_free(dfa->sets, MEM_OTHER);
+	mem_free(dfa->accepts, MEM_OTHER);
+	mem_free(dfa->next, MEM_OTHER);
+	mem_free(dfa->buckets, MEM_OTHER);
+	mem_free(dfa->scratch, MEM_OTHER);
+}
+int pattern_search(struct pattern *pattern, char *text)
+/* Tells whether the line text has a match for the pattern, in one pass over it */
+{
+	struct dfa *dfa = &pattern->search;
+	int state = 1;
+	for(unsigned char *p = (unsigned char *)text; !dfa->accepts[state]; p++)
+	{
+		if(!*p || !(state = dfa_step(dfa, state, *p)))
+			return 0;
+	}
+	return 1;
+}
+long longest_match(struct pattern *pattern, struct string *text, long start)
+/* Returns the length of the longest match for the pattern starting at start in text, not counting the \n matched by a $, or -1 if there isn't one */
+{
+	struct dfa *dfa = &pattern->longest;
+	int state = 1;
+	long length = dfa->accepts[state]?0:-1;
+	for(long i = start; i < text->length; i++)
+	{
+		if(!(state = dfa_step(dfa, state, text->buf[i])))
+			break;
+		if(dfa->accepts[state])
+			length = i + 1 - start;
+	}
+	return length > 0 && pattern->at_end?length - 1:length;
+}
+void find_starts(struct pattern *pattern, struct string *text)
+/* Sets pattern->begins for the places in text where a match for the pattern starts, in one pass backward over it */
+{
+	struct dfa *dfa = &pattern->starts;
+	if(pattern->begins_space < text->length + 1)
+	{
+		pattern->begins_space = text->length + 1;
+		pattern->begins = mem_realloc(pattern->begins, pattern->begins_space, MEM_OTHER);
+	}
+	int state = 1;
+	pattern->begins[text->length] = dfa->accepts[state];
+	for(long i = text->length - 1; i >= 0; i--)
+	{
+		state = dfa_step(dfa, state, text->buf[i]);
+		pattern->begins[i] = dfa->accepts[state];
+	}
+}
+long next_match(struct string *text, long from, long empty_from, struct string *find, struct pattern *pattern, long *length)
+/* Returns where the next match for a SUBSTITUTE's find string (or pattern, if it has one) in text starts, from from on, and stores its length
+   in length. A pattern's matches are the longest starting at each place, and may be empty, but not before empty_from, where the last match ended.
+   For a pattern, find_starts must have been called on the text first. Returns -1 if there are no more */
+{
+	if(!pattern)
+	{
+		char *found = strstr(text->buf + from, find->buf);
+		*length = find->length;
+		return found?found - text->buf:-1;
+	}
+	/* Nothing matches from the \n at the end of the line on, except an empty match or a $ just before it */
+	long last = text->length && text->buf[text->length-1] == '\n'?text->length - 1:text->length;
+	for(long i = from; i <= last && (i == 0 || !pattern->anchored); i++)
+	{
+		if(!pattern->begins[i])
+			continue;
+		*length = longest_match(pattern, text, i);
+		if(*length > 0 || (*length == 0 && i >= empty_from))
+			return i;
+	}
+	return -1;
+}
+void replace_lines(struct state_spec *state, struct string *lines, long num_lines, long pos, long num)
+/* Replaces num lines of the main buffer, starting at line pos, with the given lines; num can be 0 to insert the lines in front of pos, and num_lines 0 to delete.
+   The main buffer keeps the strings in lines, but the array itself is left for the caller to free */
+{
+	state->dollar++;
+	state->main_buffer = replace_elements_in_string_vector(state->main_buffer, &state->dollar, lines, num_lines, pos, num);
+	state->dollar--;
+	lines_changed(state, pos, num, num_lines);
+}
+void lines_changed(struct state_spec *state, long pos, long removed, long added)
+/* Must be called after every change to the main buffer, with removed lines starting at pos having been replaced by added ones. Brings the cached searches,
+   the source offsets and the lines an EVERY has yet to reach into step with it */
+{
+	patch_searches(state, pos, removed, added);
+	dirty_lines(state, pos, removed, added);
+	/* A line replaced one for one stays marked; one deleted or replaced by more or fewer lines doesn't */
+	for(long i = 0; added != removed && i < state->num_marks; i++)
+	{
+		if(state->marks[i] >= pos + removed)
+			state->marks[i] += added - removed;
+		else if(state->marks[i] >= pos)
+			state->marks[i] = 0;
+	}
+}
+void patch_searches(struct state_spec *state, long pos, long removed, long added)
+/* Starts a new edit generation after a change given as for lines_changed, bringing the state's cached searches into it: the matches in the changed lines are dropped,
+   those after them renumbered, and the added lines checked. Searches cached by other states, such as other clients of a server, are left behind in the old generation
+   and worked out again when next used */
+{
+	long old_generation = edit_generation++;
+	for(int i = 0; state->searches && i < SEARCH_CACHE; i++)
+	{
+		struct search_result *result = &state->searches[i];
+		if(result->generation != old_generation)
+			continue;
+		if(added > SEARCH_PATCH_LINES)
+		{
+			result->generation = -1;
+			continue;
+		}
+		long start = first_match_from(result, pos);
+		long end = first_match_from(result, pos + removed);
+		long new_matches = 0;
+		for(long line = pos; line < pos + added; line++)
+			new_matches += line_matches(get_line(line, state)->buf, result);
+		long num_matches = result->num_matches - (end - start) + new_matches;
+		if(num_matches > result->space)
+		{
+			result->space = num_matches*2;
+			result->matches = mem_realloc(result->matches, result->space * sizeof(long), MEM_OTHER);
+		}
+		if(result->num_matches > end)
+			memmove(result->matches + start + new_matches, result->matches + end, (result->num_matches - end) * sizeof(long));
+		for(long j = start + new_matches; j < num_matches; j++)
+			result->matches[j] += added - removed;
+		for(long line = pos; line < pos + added; line++)
+		{
+			if(line_matches(get_line(line, state)->buf, result))
+				result->matches[start++] = line;
+		}
+		result->num_matches = num_matches;
+		result->generation = edit_generation;
+	}
+}
+long mark_lines(struct string *pattern, long first, long last, long **marks, struct state_spec *state)
+/* Finds the lines from first to last that contain pattern, for EVERY, and puts their numbers in order in a new array in marks. Returns how many there are.
+   If the pattern is a cached search that is up to date, the lines come from its matches without looking at the text again */
+{
+	long num_marks = 0, space = 64;
+	struct search_result *result = cached_search(pattern, 0, state);
+	if(result->generation == edit_generation)
+	{
+		long start = first_match_from(result, first);
+		num_marks = first_match_from(result, last + 1) - start;
+		*marks = mem_alloc((num_marks?num_marks:1) * sizeof(long), MEM_OTHER);
+		memcpy(*marks, result->matches + start, num_marks * sizeof(long));
+		return num_marks;
+	}
+	*marks = mem_alloc(space * sizeof(long), MEM_OTHER);
+	for(long i = first; i <= last; i++)
+	{
+		if(!line_matches(get_line(i, state)->buf, result))
+			continue;
+		if(num_marks == space)
+		{
+			space *= 2;
+			*marks = mem_realloc(*marks, space * sizeof(long), MEM_OTHER);
+		}
+		(*marks)[num_marks++] = i;
+	}
+	return num_marks;
+}
+void delete_marked(struct state_spec *state, long *marks, long num_marks)
+/* Deletes the given lines, which are in order, from the main buffer. The lines after the first of them are moved down over the gaps in a single pass,
+   where deleting them one at a time with replace_lines would move everything after each one */
+{
+	struct source *source = state->source;
+	long first = marks[0], span = marks[num_marks-1] - first + 1;
+	long to = first, m = 0;
+	for(long from = first; from <= state->dollar; from++)
+	{
+		if(m < num_marks && marks[m] == from)
+		{
+			delete_string(&state->main_buffer[from]);
+			m++;
+			continue;
+		}
+		state->main_buffer[to] = state->main_buffer[from];
+		if(source)
+			source->offsets[to] = source->offsets[from];
+		to++;
+	}
+	state->dollar -= num_marks;
+	state->main_buffer = mem_realloc(state->main_buffer, (state->dollar+1) * sizeof(struct string), MEM_LINES);
+	/* The source offsets have been moved along with the lines, so only the searches are left to bring up to date */
+	patch_searches(state, first, span, span - num_marks);
+}
+int every_line(struct command_spec *command, long first, long last, struct state_spec *state)
+/* Implements the EVERY command: marks the lines from first to last that contain its pattern in one scan, then runs its subcommand on each of them.
+   Returns 1 if a buffer called on the lines FINISHED */
+{
+	long *marks, num_marks, i, n;
+	int finished = 0;
+	struct command_spec *sub = command->sub;
+	/* An EVERY run by a buffer that an EVERY called would lose track of the outer one's marks */
+	if(state->marks)
+	{
+		err(state);
+		return 0;
+	}
+	set_buffer(0, &command->arg1, state);
+	num_marks = mark_lines(&command->arg1, first, last, &marks, state);
+	if(!num_marks)
+	{
+		mem_free(marks, MEM_OTHER);
+		err(state);
+		return 0;
+	}
+	switch(sub->command)
+	{
+	case 'D':
+		delete_marked(state, marks, num_marks);
+		state->dot = marks[num_marks-1] - num_marks;
+		break;
+	case 'P':
+		for(i = 0; i < num_marks; i++)
+			print_string(get_line(marks[i], state));
+		state->dot = marks[num_marks-1];
+		break;
+	case 'S':
+	{
+		/* A table is read and its automaton built, or a pattern compiled, once for all the lines */
+		struct replace_table *table = NULL;
+		struct pattern *pattern = NULL;
+		if(sub->flag == 'T' && !(table = load_table(sub, state)))
+			break;
+		if(!table && state->patterns && !(pattern = new_pattern(&sub->arg2, 0)))
+		{
+			err(state);
+			break;
+		}
+		for(i = n = 0; i < num_marks && (sub->num < 0 || n < sub->num); i++)
+		{
+			long left = sub->num < 0?-1:sub->num - n;
+			n += table?substitute_table(table, marks[i], marks[i], left, state):substitute(&sub->arg1, &sub->arg2, pattern, marks[i], marks[i], sub->flag, left, state);
+		}
+		if(table)
+		{
+			if(n)
+				report_table(table);
+			free_table(table);
+		}
+		free_pattern(pattern);
+		if(n == 0)
+			err(state);
+		else
+			fprintf(term_out, "%li\r\n", n);
+		break;
+	}
+	default:
+	{
+		/* A buffer call. The commands in the buffer are read into the parser arena over this one, so nothing of it can be used once the first has been read */
+		int buf_num = buffer_for_char(sub->arg1.buf[0]);
+		for(i = 0; i < num_marks && !finished; i++)
+		{
+			if(!marks[i])
+				continue;
+			state->dot = marks[i];
+			state->marks = marks + i + 1;
+			state->num_marks = num_marks - i - 1;
+			finished = call_buffer(buf_num, state);
+		}
+		state->marks = NULL;
+		state->num_marks = 0;
+		if(finished == -1)
+			finished = 0;
+	}
+	}
+	mem_free(marks, MEM_OTHER);
+	return finished;
+}
+int call_buffer(int buf_num, struct state_spec *state)
+/* Runs the commands in a buffer, just as typing ^B and its name would, and returns once the last of them has been run.
+   Returns 1 if one of them FINISHED, or -1 if one failed, which like any error also stops the buffers that called it */
+{
+	long depth = stack_depth(state->buffer_stack);
+	int finished = 0, errors = state->errors;
+	if(!aux_buffer(buf_num, state)->length)
+		return 0;
+	struct buffer_pos *new_pos = mem_alloc(sizeof(struct buffer_pos), MEM_STACK);
+	new_pos->current_char = -1;
+	new_pos->buf_num = buf_num;
+	new_pos->prev = state->buffer_stack;
+	state->buffer_stack = new_pos;
+	while(!finished && state->errors == errors)
+	{
+		/* Stop as soon as the buffer has nothing left in it; next_char would otherwise carry on into whatever called EVERY. A last command left unfinished
+		   already has, and the buffer has been taken off the stack */
+		long now = stack_depth(state->buffer_stack);
+		if(now <= depth || (now == depth + 1 && state->buffer_stack->current_char + 1 >= aux_buffer(buf_num, state)->length))
+			break;
+		quiet = scripted;
+		struct command_spec *command = get_command(state);
+		quiet = 0;
+		if(!command)
+		{
+			err(state);
+			fprintf(term_out, "\r\n");
+			break;
+		}
+		finished = execute_command(command, state);
+		free_command_spec(command);
+	}
+	if(state->errors != errors)
+		return -1;
+	if(stack_depth(state->buffer_stack) == depth + 1)
+	{
+		new_pos = state->buffer_stack;
+		state->buffer_stack = new_pos->prev;
+		mem_free(new_pos, MEM_STACK);
+	}
+	return finished;
+}
+long stack_depth(struct buffer_pos *stack)
+/* Returns how many buffers are being executed from */
+{
+	long depth = 0;
+	for(; stack; stack = stack->prev)
+		depth++;
+	return depth;
+}
+long order_lines(long first, long last, int order, struct state_spec *state)
+/* Implements the ORDER command: sorts lines first to last of the main buffer by moving their strings around, never their text, and with ORDER_UNIQUE keeps
+   only the first of each run of identical lines. Returns how many lines are left */
+{
+	long length = last - first + 1, kept = 0;
+	/* The sort needs the text of every line at once, so in paged mode they are all read back in, and paged out again by make_room after */
+	for(long i = first; pager.limit && i <= last; i++)
+	{
+		if(state->main_buffer[i].space == SWAPPED)
+			page_in(i, state);
+	}
+	struct sort_key *keys = mem_alloc(length * sizeof(struct sort_key), MEM_OTHER);
+	for(long i = 0; i < length; i++)
+	{
+		struct string *line = &state->main_buffer[first + i];
+		keys[i].line = first + i;
+		keys[i].prefix = 0;
+		if(order & ORDER_NUMERIC)
+			keys[i].prefix = number_key(line->buf);
+		for(int j = 0; j < 8 && !(order & ORDER_NUMERIC); j++)
+			keys[i].prefix = keys[i].prefix << 8 | (j < line->length?(unsigned char)line->buf[j]:0);
+	}
+	/* A big sort is split into runs, one per processor, that are sorted on their own threads and then merged in pairs, also in parallel */
+	int num_jobs = length < SORT_PARALLEL_LINES?1:sysconf(_SC_NPROCESSORS_ONLN);
+	if(num_jobs > MAX_SORT_JOBS)
+		num_jobs = MAX_SORT_JOBS;
+	if(num_jobs < 1)
+		num_jobs = 1;
+	struct sort_key *spare = mem_alloc(length * sizeof(struct sort_key), MEM_OTHER);
+	struct sort_job jobs[num_jobs];
+	long bounds[num_jobs+1];
+	for(int i = 0; i <= num_jobs; i++)
+		bounds[i] = length * i / num_jobs;
+	for(int i = 0; i < num_jobs; i++)
+		jobs[i] = (struct sort_job){keys + bounds[i], spare + bounds[i], bounds[i+1] - bounds[i], 0, order, state->main_buffer};
+	run_sort_jobs(jobs, num_jobs);
+	for(int runs = num_jobs; runs > 1; runs = (runs+1)/2)
+	{
+		int n = 0;
+		for(int i = 0; i + 1 < runs; i += 2)
+			jobs[n++] = (struct sort_job){keys + bounds[i], spare + bounds[i], bounds[i+2] - bounds[i], bounds[i+1] - bounds[i], order, state->main_buffer};
+		run_sort_jobs(jobs, n);
+		for(int i = 0; i < (runs+1)/2; i++)
+			bounds[i] = bounds[2*i];
+		bounds[(runs+1)/2] = length;
+	}
+	mem_free(spare, MEM_OTHER);
+	/* Put the strings in their new order, leaving out repeats if asked to */
+	struct string *sorted = mem_alloc(length * sizeof(struct string), MEM_LINES);
+	for(long i = 0, last_kept = 0; i < length; i++)
+	{
+		if(order & ORDER_UNIQUE && i && !compare_keys(&keys[last_kept], &keys[i], &jobs[0]))
+			delete_string(&state->main_buffer[keys[i].line]);
+		else
+		{
+			sorted[kept++] = state->main_buffer[keys[i].line];
+			last_kept = i;
+		}
+	}
+	mem_free(keys, MEM_OTHER);
+	memcpy(state->main_buffer + first, sorted, kept * sizeof(struct string));
+	mem_free(sorted, MEM_LINES);
+	if(kept < length)
+	{
+		memmove(state->main_buffer + first + kept, state->main_buffer + last + 1, (state->dollar - last) * sizeof(struct string));
+		state->dollar -= length - kept;
+		state->main_buffer = mem_realloc(state->main_buffer, (state->dollar+1) * sizeof(struct string), MEM_LINES);
+	}
+	lines_changed(state, first, length, kept);
+	make_room(state);
+	return kept;
+}
+unsigned long number_key(char *text)
+/* Returns a sort key for the number a line starts with, after any blanks, for ORDER:N; keys compare as unsigned numbers in the same order as the numbers.
+   A line that doesn't start with a number counts as 0 */
+{
+	double number = 0, scale = 1;
+	unsigned long key;
+	int negative = 0;
+	while(*text == ' ' || *text == '\t')
+		text++;
+	if(*text == '-' || *text == '+')
+		negative = *text++ == '-';
+	for(; isdigit((unsigned char)*text); text++)
+		number = number * 10 + *text - '0';
+	if(*text == '.')
+	{
+		for(text++; isdigit((unsigned char)*text); text++)
+			number += (*text - '0') * (scale /= 10);
+	}
+	number = negative && number?-number:number;
+	/* The bits of a double order the same way as the number for positive numbers and the opposite way for negative ones */
+	memcpy(&key, &number, sizeof(key));
+	return key >> 63?~key:key | 1UL << 63;
+}
+int compare_keys(struct sort_key *a, struct sort_key *b, struct sort_job *job)
+/* Compares two lines for ORDER, returning less than, equal to or greater than 0 as a goes before, with or after b. Lines with the same prefix are compared by their text */
+{
+	int c;
+	if(a->prefix != b->prefix)
+		c = a->prefix < b->prefix?-1:1;
+	else
+		c = strcmp(job->lines[a->line].buf, job->lines[b->line].buf);
+	return job->order & ORDER_REVERSE?-c:c;
+}
+void sort_keys(struct sort_key *keys, struct sort_key *spare, long length, struct sort_job *job)
+/* Sorts length keys with a merge sort, which keeps lines that compare equal in the order they were in. spare must have room for half of them */
+{
+	if(length <= 16)
+	{
+		for(long i = 1; i < length; i++)
+		{
+			struct sort_key key = keys[i];
+			long j = i;
+			for(; j > 0 && compare_keys(&keys[j-1], &key, job) > 0; j--)
+				keys[j] = keys[j-1];
+			keys[j] = key;
+		}
+		return;
+	}
+	long half = length/2;
+	sort_keys(keys, spare, half, job);
+	sort_keys(keys + half, spare, length - half, job);
+	merge_keys(keys, spare, length, half, job);
+}
+void merge_keys(struct sort_key *keys, struct sort_key *spare, long length, long half, struct sort_job *job)
+/* Merges the sorted runs of keys before and after half into one. The first run is moved out into spare to make room, so spare must have room for half keys */
+{
+	if(compare_keys(&keys[half-1], &keys[half], job) <= 0)
+		return;
+	memcpy(spare, keys, half * sizeof(struct sort_key));
+	long i = 0, j = half, k = 0;
+	while(i < half && j < length)
+		keys[k++] = compare_keys(&keys[j], &spare[i], job) < 0?keys[j++]:spare[i++];
+	memcpy(keys + k, spare + i, (half - i) * sizeof(struct sort_key));
+}
+void *sort_job(void *arg)
+/* Does a sort_job. Run on its own thread by run_sort_jobs */
+{
+	struct sort_job *job = arg;
+	if(job->half)
+		merge_keys(job->keys, job->spare, job->length, job->half, job);
+	else
+		sort_keys(job->keys, job->spare, job->length, job);
+	return NULL;
+}
+void run_sort_jobs(struct sort_job *jobs, int num_jobs)
+/* Does the given sort jobs in parallel, the first on this thread, and returns when they are all done */
+{
+	pthread_t threads[num_jobs];
+	int started[num_jobs];
+	for(int i = 1; i < num_jobs; i++)
+		started[i] = !pthread_create(&threads[i], NULL, sort_job, &jobs[i]);
+	sort_job(&jobs[0]);
+	for(int i = 1; i < num_jobs; i++)
+	{
+		if(started[i])
+			pthread_join(threads[i], NULL);
+		else
+			sort_job(&jobs[i]);
+	}
+}
+void start_source(struct state_spec *state, int fd)
+/* Makes the regular file open on fd the state's source, with none of the lines of the main buffer in it yet (see source_lines). Any old source is forgotten */
+{
+	struct stat file_stat;
+	free_source(state->source);
+	state->source = NULL;
+	if(fstat(fd, &file_stat) || !S_ISREG(file_stat.st_mode))
+		return;
+	struct source *source = mem_alloc(sizeof(struct source), MEM_OTHER);
+	source->device = file_stat.st_dev;
+	source->inode = file_stat.st_ino;
+	source->size = file_stat.st_size;
+	source->modified = file_stat.st_mtim;
+	source->index = NULL;
+	source->space = state->dollar + 1;
+	source->offsets = mem_alloc(source->space * sizeof(long), MEM_LINES);
+	for(long i = 0; i < source->space; i++)
+		source->offsets[i] = -1;
+	state->source = source;
+}
+long source_lines(struct state_spec *state, long first, long num_lines, long offset)
+/* Records that num_lines lines of the main buffer starting at first were read from the source one after the other, starting at offset. Returns the offset after them */
+{
+	for(long i = first; state->source && i < first + num_lines; i++)
+	{
+		state->source->offsets[i] = offset;
+		offset += state->main_buffer[i].length;
+	}
+	return offset;
+}
+void check_source(struct state_spec *state, int fd, long num_bytes, long last_line)
+/* Called once a READ FROM has read its whole source, num_bytes of lines ending with last_line, to make sure the lines are exactly what is in the file.
+   A last line that had no \n had one added, so it is marked as changed. If the lines came out any other size, as when a \0 ended the file early, the source is forgotten */
+{
+	struct source *source = state->source;
+	char last;
+	if(!source)
+		return;
+	if(num_bytes == source->size + 1)
+		source->offsets[last_line] = -1;
+	else if(num_bytes != source->size || pread(fd, &last, 1, source->size - 1) != 1 || last != '\n')
+	{
+		free_source(source);
+		state->source = NULL;
+	}
+}
+int is_source(struct state_spec *state, struct stat *file_stat)
+/* Returns whether file_stat is of the state's source, unchanged since it was read or written */
+{
+	struct source *source = state->source;
+	return source && file_stat->st_dev == source->device && file_stat->st_ino == source->inode && file_stat->st_size == source->size &&
+		file_stat->st_mtim.tv_sec == source->modified.tv_sec && file_stat->st_mtim.tv_nsec == source->modified.tv_nsec;
+}
+void dirty_lines(struct state_spec *state, long pos, long removed, long added)
+/* Keeps the source offsets in step with a change to the main buffer, given as for lines_changed: the offsets of the lines after the change move with them, and the added lines aren't in the file */
+{
+	struct source *source = state->source;
+	if(!source)
+		return;
+	long num_lines = state->dollar + 1;
+	if(num_lines > source->space)
+	{
+		source->space = num_lines * 2;
+		source->offsets = mem_realloc(source->offsets, source->space * sizeof(long), MEM_LINES);
+	}
+	if(added != removed)
+		memmove(source->offsets + pos + added, source->offsets + pos + removed, (num_lines - pos - added) * sizeof(long));
+	for(long i = pos; i < pos + added; i++)
+		source->offsets[i] = -1;
+}
+void free_source(struct source *source)
+{
+	if(!source)
+		return;
+	free_index(source->index);
+	mem_free(source->offsets, MEM_LINES);
+	mem_free(source, MEM_OTHER);
+}
+unsigned long hash_line(unsigned long hash, struct string *line)
+/* Adds the text of a line to a hash of the lines before it, eight bytes at a time. Starting from 0, this gives the content hash a search index is tagged with */
+{
+	unsigned long word;
+	long i;
+	for(i = 0; i + 8 <= line->length; i += 8)
+	{
+		memcpy(&word, line->buf + i, 8);
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15UL;
+		hash ^= hash >> 29;
+	}
+	word = line->length;
+	memcpy(&word, line->buf + i, line->length - i);
+	hash = (hash ^ word ^ ((unsigned long)line->length << 56)) * 0x9E3779B97F4A7C15UL;
+	return hash ^ (hash >> 29);
+}
+struct line_index *new_line_index(char *path)
+/* Constructor for the index of a source being read from path, which isn't ready until finish_index */
+{
+	struct line_index *index = mem_calloc(1, sizeof(struct line_index), MEM_OTHER);
+	index->path = mem_alloc(strlen(path) + 6, MEM_OTHER);
+	sprintf(index->path, "%s.qedx", path);
+	index->generation = -1;
+	return index;
+}
+void finish_index(struct state_spec *state, unsigned long hash)
+/* Called once a READ FROM that is making an index of its source has read all of it, with hash_line of all its lines. The index becomes good for
+   the main buffer as it is now, and is mapped from its sidecar if that was made from a file just like this one. Otherwise it is built when first searched */
+{
+	struct line_index *index = state->source?state->source->index:NULL;
+	if(!index)
+		return;
+	index->hash = hash;
+	index->generation = edit_generation;
+	map_index(index, state->source, state->dollar);
+}
+int map_index(struct line_index *index, struct source *source, long num_lines)
+/* Maps the index's sidecar, if it has one made from a file of the source's size, modification time and contents with num_lines lines. Returns 1 if it does */
+{
+	struct stat file_stat;
+	int fd = open(index->path, O_RDONLY);
+	if(fd < 0)
+		return 0;
+	void *map = MAP_FAILED;
+	if(!fstat(fd, &file_stat) && file_stat.st_size >= (off_t)sizeof(struct index_header))
+		map = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return 0;
+	struct index_header *header = map;
+	if(memcmp(header->magic, "QEDX", 4) || header->version != INDEX_VERSION || header->size != source->size || header->modified_sec != source->modified.tv_sec ||
+		header->modified_nsec != source->modified.tv_nsec || header->hash != index->hash || header->num_lines != num_lines || header->trigram_bytes < 0 || header->tag_bytes < 0 ||
+		file_stat.st_size != (off_t)(sizeof(struct index_header) + 2 * (INDEX_BUCKETS + 1) * sizeof(long) + header->trigram_bytes + header->tag_bytes))
+	{
+		munmap(map, file_stat.st_size);
+		return 0;
+	}
+	index->header = header;
+	index->length = file_stat.st_size;
+	index->mapped = 1;
+	place_tables(index);
+	/* A header that matches doesn't vouch for the tables after it, so check that every list lies within the postings before using any */
+	if(!check_starts(index->trigram_starts, header->trigram_bytes) || !check_starts(index->tag_starts, header->tag_bytes))
+	{
+		munmap(map, file_stat.st_size);
+		index->header = NULL;
+		index->mapped = 0;
+		return 0;
+	}
+	return 1;
+}
+int check_starts(long *starts, long bytes)
+/* Tells whether a table of where posting lists start, as read from a sidecar, runs from 0 up to no more than bytes without going backwards */
+{
+	if(starts[0] != 0)
+		return 0;
+	for(int i = 0; i < INDEX_BUCKETS; i++)
+	{
+		if(starts[i+1] < starts[i])
+			return 0;
+	}
+	return starts[INDEX_BUCKETS] <= bytes;
+}
+void build_index(struct line_index *index, struct state_spec *state)
+/* Builds the index from the lines of the main buffer, which are still just as they were read, and saves it to the sidecar. The sidecar is written under
+   another name and renamed, so that a qed killed partway through can't leave half an index behind. If it can't be written the index is only kept in memory */
+{
+	long tables = sizeof(struct index_header) + 2 * (INDEX_BUCKETS + 1) * sizeof(long);
+	long *starts = mem_calloc(2 * (INDEX_BUCKETS + 1), sizeof(long), MEM_OTHER);
+	long trigram_bytes = index_table(0, starts, NULL, state);
+	long tag_bytes = index_table(1, starts + INDEX_BUCKETS + 1, NULL, state);
+	index->length = tables + trigram_bytes + tag_bytes;
+	index->header = mem_calloc(1, index->length, MEM_OTHER);
+	index->mapped = 0;
+	memcpy(index->header->magic, "QEDX", 4);
+	index->header->version = INDEX_VERSION;
+	index->header->size = state->source->size;
+	index->header->modified_sec = state->source->modified.tv_sec;
+	index->header->modified_nsec = state->source->modified.tv_nsec;
+	index->header->hash = index->hash;
+	index->header->num_lines = state->dollar;
+	index->header->trigram_bytes = trigram_bytes;
+	index->header->tag_bytes = tag_bytes;
+	place_tables(index);
+	memcpy(index->trigram_starts, starts, 2 * (INDEX_BUCKETS + 1) * sizeof(long));
+	mem_free(starts, MEM_OTHER);
+	index_table(0, index->trigram_starts, index->trigram_postings, state);
+	index_table(1, index->tag_starts, index->tag_postings, state);
+	char *temp = mem_alloc(strlen(index->path) + 24, MEM_OTHER);
+	sprintf(temp, "%s.%d", index->path, (int)getpid());
+	int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd >= 0)
+	{
+		long written = 0, n = 0;
+		while(written < index->length && ((n = write(fd, (char *)index->header + written, index->length - written)) > 0 || (n < 0 && errno == EINTR)))
+			written += n > 0?n:0;
+		close(fd);
+		if(written < index->length || rename(temp, index->path))
+			unlink(temp);
+	}
+	mem_free(temp, MEM_OTHER);
+}
+void place_tables(struct line_index *index)
+/* Points the index's tables at where they are laid out after its header */
+{
+	index->trigram_starts = (long *)(index->header + 1);
+	index->tag_starts = index->trigram_starts + INDEX_BUCKETS + 1;
+	index->trigram_postings = (unsigned char *)(index->tag_starts + INDEX_BUCKETS + 1);
+	index->tag_postings = index->trigram_postings + index->header->trigram_bytes;
+}
+long index_table(int tags, long *starts, unsigned char *postings, struct state_spec *state)
+/* Makes the table of tags, or of trigrams, of an index of the main buffer. With postings NULL it only works out how long each list will be, setting starts to where
+   each will start and returning how long they are together. Given the starts worked out that way, it then fills in the lists in postings */
+{
+	long *last = mem_calloc(INDEX_BUCKETS, sizeof(long), MEM_OTHER);  /* The last line put in each list */
+	long *ends = starts;  /* Where each list has got to; while counting, each list's length */
+	if(postings)
+	{
+		ends = mem_alloc(INDEX_BUCKETS * sizeof(long), MEM_OTHER);
+		memcpy(ends, starts, INDEX_BUCKETS * sizeof(long));
+	}
+	for(long line = 1; line <= state->dollar; line++)
+	{
+		struct string *text = get_line(line, state);
+		/* The \n at the end of the line is left out, since nothing searched for can have one */
+		long keys = tags?1:text->length - 3;
+		for(long i = 0; i < keys; i++)
+		{
+			int bucket = tags?tag_bucket(text->buf, text->length):trigram_bucket(text->buf + i);
+			if(last[bucket] == line)
+				continue;
+			ends[bucket] += put_gap(postings?postings + ends[bucket]:NULL, line - last[bucket]);
+			last[bucket] = line;
+		}
+	}
+	long total = 0;
+	if(!postings)
+	{
+		for(int i = 0; i < INDEX_BUCKETS; i++)
+		{
+			long length = starts[i];
+			starts[i] = total;
+			total += length;
+		}
+		starts[INDEX_BUCKETS] = total;
+	}
+	else
+		mem_free(ends, MEM_OTHER);
+	mem_free(last, MEM_OTHER);
+	return total;
+}
+int put_gap(unsigned char *p, unsigned long gap)
+/* Writes a gap between line numbers into a posting list at p, unless p is NULL. Returns how many bytes it takes */
+{
+	int n = 0;
+	while(gap >= 0x80)
+	{
+		if(p)
+			p[n] = (gap & 0x7F) | 0x80;
+		gap >>= 7;
+		n++;
+	}
+	if(p)
+		p[n] = gap;
+	return n + 1;
+}
+int trigram_bucket(char *text)
+/* The bucket of the trigram made by the first three bytes of text */
+{
+	unsigned long trigram = (unsigned char)text[0] << 16 | (unsigned char)text[1] << 8 | (unsigned char)text[2];
+	return (trigram * 0x9E3779B97F4A7C15UL) >> 48;
+}
+int tag_bucket(char *text, long length)
+/* The bucket of the tag the first length bytes of text start with: the letters and digits up to the first byte that isn't one */
+{
+	unsigned long hash = 0;
+	for(long i = 0; i < length && isalnum((unsigned char)text[i]); i++)
+		hash = (hash ^ (unsigned char)text[i]) * 0x100000001B3UL;
+	return (hash * 0x9E3779B97F4A7C15UL) >> 48;
+}
+struct line_index *ready_index(struct state_spec *state)
+/* Returns the index of the main buffer, building it if this is the first search since it was read, or NULL if there isn't a good one.
+   An index that has been left behind by a change to the main buffer is let go of then */
+{
+	struct line_index *index = state->source?state->source->index:NULL;
+	if(!index || index->generation == -1)
+		return NULL;
+	if(index->generation != edit_generation)
+	{
+		free_index(index);
+		state->source->index = NULL;
+		return NULL;
+	}
+	if(!index->header)
+		build_index(index, state);
+	return index;
+}
+int index_matches(struct line_index *index, struct search_result *result, struct state_spec *state)
+/* Works out the matches of a literal search from the lines the index has all its trigrams in, or for a tag search, its tag. Returns 0 if the
+   index is no help, as for a search shorter than a trigram */
+{
+	struct string *search = &result->search;
+	long *candidates, num_candidates;
+	if(result->is_tag)
+	{
+		int bucket = tag_bucket(search->buf, search->length);
+		long *starts = index->tag_starts;
+		candidates = mem_alloc((starts[bucket+1] - starts[bucket] + 1) * sizeof(long), MEM_OTHER);
+		num_candidates = read_postings(index->tag_postings + starts[bucket], index->tag_postings + starts[bucket+1], candidates, state->dollar);
+	}
+	else
+	{
+		if(search->length < 3)
+			return 0;
+		/* Start from the shortest list and narrow it down with the others */
+		long *starts = index->trigram_starts, num_buckets = search->length - 2, shortest = 0;
+		int *buckets = mem_alloc(num_buckets * sizeof(int), MEM_OTHER);
+		for(long i = 0; i < num_buckets; i++)
+		{
+			buckets[i] = trigram_bucket(search->buf + i);
+			if(starts[buckets[i]+1] - starts[buckets[i]] < starts[buckets[shortest]+1] - starts[buckets[shortest]])
+				shortest = i;
+		}
+		int first = buckets[shortest];
+		candidates = mem_alloc((starts[first+1] - starts[first] + 1) * sizeof(long), MEM_OTHER);
+		num_candidates = read_postings(index->trigram_postings + starts[first], index->trigram_postings + starts[first+1], candidates, state->dollar);
+		for(long i = 0; i < num_buckets && num_candidates; i++)
+		{
+			if(buckets[i] == first)
+				continue;
+			unsigned char *p = index->trigram_postings + starts[buckets[i]], *end = index->trigram_postings + starts[buckets[i]+1];
+			long line = 0, kept = 0, j = 0, gap;
+			while(j < num_candidates && (gap = get_gap(&p, end, state->dollar - line)))
+			{
+				line += gap;
+				while(j < num_candidates && candidates[j] < line)
+					j++;
+				if(j < num_candidates && candidates[j] == line)
+					candidates[kept++] = candidates[j++];
+			}
+			num_candidates = kept;
+		}
+		mem_free(buckets, MEM_OTHER);
+	}
+	for(long i = 0; i < num_candidates; i++)
+	{
+		if(line_matches(get_line(candidates[i], state)->buf, result))
+			add_match(result, candidates[i]);
+	}
+	mem_free(candidates, MEM_OTHER);
+	return 1;
+}
+long read_postings(unsigned char *p, unsigned char *end, long *lines, long last)
+/* Reads the line numbers, up to last, in the posting list from p to end into lines. Returns how many there are */
 {
-	if(isdigit(c))
-		return (int)c-'0';
-	else if(isalpha(c))
-		return c-'A'+10;
-	else
-		return -1;
+	long n = 0, line = 0, gap;
+	while((gap = get_gap(&p, end, last - line)))
+	{
+		line += gap;
+		lines[n++] = line;
+	}
+	return n;
 }
-void kill_buffer(int buffer_num, struct state_spec *state)
-/* Executes the KILL buffer command, clearing the contents of the given-numbered buffer */
+long get_gap(unsigned char **p, unsigned char *end, long room)
+/* Reads the gap at *p in a posting list ending at end, moving *p past it. Returns 0 at the end of the list, or if the gap runs past it
+   or is more than room, as it can only be in a damaged sidecar */
 {
-	delete_string(&state->aux_buffers[buffer_num]);
+	unsigned long gap = 0;
+	int shift = 0;
+	while(*p < end && shift < 63)
+	{
+		unsigned char byte = *(*p)++;
+		gap |= (unsigned long)(byte & 0x7F) << shift;
+		shift += 7;
+		if(!(byte & 0x80))
+			return gap > 0 && gap <= (unsigned long)room?gap:0;
+	}
+	return 0;
 }
-void set_buffer(int buffer_num, struct string *new_text, struct state_spec *state)
-/* Sets the contents of the given-numbered buffer to the given text, such as by the JAM INTO command */
+void free_index(struct line_index *index)
 {
-	copy_string(&state->aux_buffers[buffer_num], new_text, 0);
+	if(!index)
+		return;
+	if(index->mapped)
+		munmap(index->header, index->length);
+	else
+		mem_free(index->header, MEM_OTHER);
+	mem_free(index->path, MEM_OTHER);
+	mem_free(index, MEM_OTHER);
 }
-int find_string(struct string *search, int start_line, int is_tag, struct state_spec *state)
-/* Implements the behavior of searches [] and tag searches :: by searching for the given string in the main buffer, starting from the given line and wrapping */
+int write_changes(char *path, long *bytes_written, struct state_spec *state)
+/* WRITE ON of the whole main buffer, if path is its source and hasn't changed since it was read: only the lines that have changed are written, with the rest taken from the file as it is.
+   If every unchanged line is still at the same place in the file, the changed ones are written over the file in place. Otherwise a new file is put together next to it,
+   with the unchanged runs of lines copied over by copy_file_range (which on filesystems that support it shares them rather than copying them), and renamed over it.
+   Renaming would replace a symbolic link, or split the file from its other hard links, so for those, and for a file whose owner can't be kept, the whole file is written as usual.
+   Returns 1 and stores the size of the file in bytes_written if it wrote the file, 0 if it isn't the source (and nothing was written), or -1 if writing failed */
 {
-	int i;
-	char *found;
-	char next;
-	for(i = start_line; i <= state->dollar; i++)
+	struct source *source = state->source;
+	struct stat file_stat;
+	if(stat(path, &file_stat) || !is_source(state, &file_stat))
+		return 0;
+	long position = 0;
+	int in_place = 1;
+	for(long i = 1; i <= state->dollar; i++)
 	{
-		found = strstr(state->main_buffer[i].buf, search->buf);
-		if(is_tag)
+		if(source->offsets[i] >= 0 && source->offsets[i] != position)
+			in_place = 0;
+		position += state->main_buffer[i].length;
+	}
+	struct stat link_stat;
+	if(!in_place && (lstat(path, &link_stat) || S_ISLNK(link_stat.st_mode) || link_stat.st_nlink > 1))
+		return 0;
+	char *temp_path = NULL;
+	int in = open(path, in_place?O_WRONLY:O_RDONLY);
+	int out = in;
+	if(in < 0)
+		return -1;
+	if(!in_place)
+	{
+		temp_path = mem_alloc(strlen(path) + 12, MEM_OTHER);
+		sprintf(temp_path, "%s.qedXXXXXX", path);
+		out = mkstemp(temp_path);
+		struct stat temp_stat;
+		if(out >= 0 && (fstat(out, &temp_stat) || ((temp_stat.st_uid != file_stat.st_uid || temp_stat.st_gid != file_stat.st_gid) && fchown(out, file_stat.st_uid, file_stat.st_gid))))
 		{
-			next = found?found[search->length]:'0';
-			if(found == state->main_buffer[i].buf && next && !isalnum(next))
-				return i;
+			/* The new file would have a different owner */
+			close(out);
+			unlink(temp_path);
+			close(in);
+			mem_free(temp_path, MEM_OTHER);
+			return 0;
+		}
+		if(out < 0)
+		{
+			close(in);
+			mem_free(temp_path, MEM_OTHER);
+			return -1;
 		}
-		else if(found)
-			return i;
 	}
-	for(i = 1; i < start_line; i++)
+	char *buf = mem_alloc(LOAD_CHUNK, MEM_OTHER);  /* Changed lines waiting to be written out at position */
+	long buf_length = 0;
+	long copy_from = 0, copy_length = 0;  /* Unchanged lines waiting to be copied from the old file */
+	int failed = 0;
+	position = 0;
+	for(long i = 1; i <= state->dollar + 1 && !failed; i++)
 	{
-		found = strstr(state->main_buffer[i].buf, search->buf);
-		if(is_tag)
+		long offset = i <= state->dollar?source->offsets[i]:-1;
+		if(copy_length && offset != copy_from + copy_length)
 		{
-			next = found?found[search->length]:'0';
-			if(found == state->main_buffer[i].buf && next && !isalnum(next))
-				return i;
+			loff_t from = copy_from, to = position;
+			while(!in_place && copy_length > 0)
+			{
+				long n = copy_file_range(in, &from, out, &to, copy_length, 0);
+				if(n <= 0)
+				{
+					/* Fall back on copying through buf, which is empty while lines are being copied */
+					n = pread(in, buf, copy_length < LOAD_CHUNK?copy_length:LOAD_CHUNK, from);
+					if(n <= 0 || pwrite(out, buf, n, to) != n)
+					{
+						failed = 1;
+						break;
+					}
+					from += n;
+					to += n;
+				}
+				position += n;
+				copy_length -= n;
+			}
+			position += copy_length;
+			copy_length = 0;
 		}
-		else if(found)
-			return i;
+		if(i > state->dollar)
+			break;
+		long length = state->main_buffer[i].length;
+		if(offset >= 0)
+		{
+			if(buf_length && flush_written(out, buf, &buf_length, &position))
+				failed = 1;
+			if(!copy_length)
+				copy_from = offset;
+			copy_length += length;
+			continue;
+		}
+		struct string *line = get_line(i, state);
+		if(buf_length + length > LOAD_CHUNK && flush_written(out, buf, &buf_length, &position))
+			failed = 1;
+		if(length > LOAD_CHUNK)
+		{
+			if(pwrite(out, line->buf, length, position) != length)
+				failed = 1;
+			position += length;
+		}
+		else
+		{
+			memcpy(buf + buf_length, line->buf, length);
+			buf_length += length;
+		}
+	}
+	if(buf_length && flush_written(out, buf, &buf_length, &position))
+		failed = 1;
+	mem_free(buf, MEM_OTHER);
+	if(in_place ? ftruncate(out, position) : fchmod(out, file_stat.st_mode & 07777))
+		failed = 1;
+	if(!failed)
+		fstat(out, &file_stat);
+	if(!in_place)
+	{
+		close(in);
+		if(failed || rename(temp_path, path))
+		{
+			unlink(temp_path);
+			failed = 1;
+		}
+		mem_free(temp_path, MEM_OTHER);
 	}
+	close(out);
+	if(failed)
+		return -1;
+	/* The file now holds exactly the main buffer */
+	source->device = file_stat.st_dev;
+	source->inode = file_stat.st_ino;
+	source->size = file_stat.st_size;
+	source->modified = file_stat.st_mtim;
+	source_lines(state, 1, state->dollar, 0);
+	*bytes_written = position;
+	return 1;
+}
+int flush_written(int fd, char *buf, long *length, long *position)
+/* Writes the length bytes in buf to fd at position for write_changes, moving position past them and emptying buf. Returns -1 if the write failed */
+{
+	long n = pwrite(fd, buf, *length, *position);
+	*position += *length;
+	if(n != *length)
+		return -1;
+	*length = 0;
 	return 0;
 }
-int substitute(struct string *replace, struct string *find, int start, int end, char mode, int num, struct state_spec *state)
-/* Implements the SUBSTITUTE command */
+long substitute(struct string *replace, struct string *find, struct pattern *pattern, long start, long end, char mode, long num, struct state_spec *state)
+/* Implements the SUBSTITUTE command. Each changed line is put together once, from the text between its matches and the replacements,
+   so a long line with many matches costs no more than one copy of it. With NOTATION PATTERNS on, find has been compiled into pattern */
 {
-	int num_subs = 0;
-	for(int line = start; line <= end; line++)
+	long num_subs = 0;
+	for(long line = start; line <= end; line++)
 	{
-		char *found;
-		struct string *old_str = &state->main_buffer[line];
-		int made_sub = 0, start_from = 0;
-		while((found = strstr(old_str->buf+start_from, find->buf)))
+		long pos, length;
+		struct string *old_str = get_line(line, state);
+		struct string *new_str = NULL;  /* The new line, as far as the old line has been copied into it */
+		long copied = 0;
+		long start_from = 0;
+		long empty_from = 0;
+		if(pattern)
+			find_starts(pattern, old_str);
+		while((pos = next_match(old_str, start_from, empty_from, find, pattern, &length)) >= 0)
 		{
 			if(num >= 0 &&num_subs >= num)
-				return num_subs;
-			int pos = found-old_str->buf;
-			start_from = pos + replace->length;
-			struct string *new_str = cat_slice(NULL, old_str, 0, pos);
-			//dbg_string(new_str);
+				break;
+			start_from = pos + (length?length:1);
+			empty_from = pos + length + 1;
 			if(mode == 'W' || mode == 'V')  /* "ask-the-user" mode */
 			{
 				char c, lastchar = '0';
 				int skip = 0;
-				printf("%s\"%s\"%s\r", new_str->buf, find->buf, found+find->length);
+				fprintf(term_out, "%s%.*s\"%.*s\"%s\r", new_str?new_str->buf:"", (int)(pos-copied), old_str->buf+copied, (int)length, old_str->buf+pos, old_str->buf+pos+length);
 				do
 				{
 					next_char(&c, 1, 1, 0, state);
@@ -319,29 +2771,262 @@ int substitute(struct string *replace, struct string *find, int start, int end,
 					}
 					lastchar = c;
 				} while(1);
-				printf("\r\n");
+				fprintf(term_out, "\r\n");
 				if(skip)
-				{
-					free_string(new_str);
 					continue;
-				}
 			}
+			if(!new_str)
+				new_str = string_with_capacity(NULL, old_str->length);
+			cat_slice(new_str, old_str, copied, pos - copied);
 			cat_strings(new_str, replace);
-			//dbg_string(new_str);
-			cat_slice(new_str, old_str, pos + find->length, -1);
-			//dbg_string(new_str);
-			state->main_buffer[line] = *new_str;
-			free(new_str);
+			copied = pos + length;
+			num_subs++;
+		}
+		if(new_str)
+		{
+			cat_slice(new_str, old_str, copied, -1);
+			delete_string(&state->main_buffer[line]);
+			state->main_buffer[line] = *intern_string(new_str);
+			mem_free(new_str, MEM_STRINGS);
+			lines_changed(state, line, 1, 1);
+			if(mode == 'L' || mode == 'V')
+				print_string(&state->main_buffer[line]);
+		}
+		if(num >= 0 && num_subs >= num)
+			return num_subs;
+	}
+	return num_subs;
+}
+struct replace_table *load_table(struct command_spec *command, struct state_spec *state)
+/* Reads the table of a SUBSTITUTE:T from the aux buffer named in arg1 or the file named in arg2 and builds its automaton. Returns NULL, having
+   reported the error, if the table can't be read or a line of it is no good */
+{
+	struct replace_table *table = mem_calloc(1, sizeof(struct replace_table), MEM_OTHER);
+	char separator = '\r';
+	if(command->arg1.buf)
+	{
+		struct string *buffer = aux_buffer(buffer_for_char(command->arg1.buf[0]), state);
+		if(buffer->buf)
+			copy_string(&table->text, buffer, 0);
+	}
+	else
+	{
+		FILE *file = fopen(command->arg2.buf, "r");
+		struct stat file_stat;
+		if(!file || fstat(fileno(file), &file_stat))
+		{
+			if(file)
+				fclose(file);
+			mem_free(table, MEM_OTHER);
+			err(state);
+			fprintf(term_out, "I-O ERROR.\r\n");
+			return NULL;
+		}
+		read_string_from_file(&table->text, file_stat.st_size, file);
+		fclose(file);
+		separator = '\n';
+	}
+	for(long i = 0; i < table->text.length; i++)
+	{
+		if(table->text.buf[i] == separator)
+			table->text.buf[i] = '\0';
+	}
+	if(!parse_table(table))
+	{
+		free_table(table);
+		err(state);
+		return NULL;
+	}
+	build_automaton(table);
+	return table;
+}
+int parse_table(struct replace_table *table)
+/* Splits the text of a table, with its line separators already turned into \0, into pairs. Each line is written as the strings of a
+   SUBSTITUTE are, new then old, as in /new/old/, and blank lines are skipped. Returns 0 if a line is no good or there are no pairs */
+{
+	char *text = table->text.buf;
+	long length = table->text.length;
+	long space = 0;
+	for(long start = 0, end; start < length; start = end + 1)
+	{
+		end = start + strlen(text + start);
+		if(end == start)
+			continue;
+		char delim = text[start];
+		char *middle = memchr(text + start + 1, delim, end - start - 1);
+		char *last = middle?memchr(middle + 1, delim, text + end - middle - 1):NULL;
+		if(!last || last != text + end - 1 || last == middle + 1)
+			return 0;
+		if(table->num_pairs == space)
+		{
+			space = space?space * 2:64;
+			table->pairs = mem_realloc(table->pairs, space * sizeof(struct replace_pair), MEM_OTHER);
+		}
+		struct replace_pair *pair = &table->pairs[table->num_pairs++];
+		pair->line = start;
+		pair->line_length = end - start;
+		pair->replace = start + 1;
+		pair->replace_length = middle - text - start - 1;
+		pair->find = middle + 1 - text;
+		pair->find_length = last - middle - 1;
+		pair->count = 0;
+	}
+	return table->num_pairs > 0;
+}
+void build_automaton(struct replace_table *table)
+/* Builds the automaton that finds the old strings of a table's pairs: a trie of the strings, then, breadth first, the transitions out of each
+   state for the bytes its trie node has no child for, taken from the state for the longest proper suffix of its text (its failure state).
+   Where two pairs have the same old string, the first is used */
+{
+	char *text = table->text.buf;
+	long num_states = 1;
+	int num_classes = 1;
+	int c;
+	memset(table->classes, 0, 256);
+	for(long i = 0; i < table->num_pairs; i++)
+	{
+		num_states += table->pairs[i].find_length;
+		for(long j = 0; j < table->pairs[i].find_length; j++)
+		{
+			unsigned char byte = text[table->pairs[i].find + j];
+			if(!table->classes[byte])
+				table->classes[byte] = num_classes++;
+		}
+	}
+	table->num_classes = num_classes;
+	table->next = mem_calloc(num_states * num_classes, sizeof(int), MEM_OTHER);
+	table->depth = mem_alloc(num_states * sizeof(int), MEM_OTHER);
+	table->match = mem_alloc(num_states * sizeof(int), MEM_OTHER);
+	int *fail = mem_alloc(num_states * sizeof(int), MEM_OTHER);
+	int *queue = mem_alloc(num_states * sizeof(int), MEM_OTHER);
+	table->depth[0] = 0;
+	table->match[0] = -1;
+	table->num_states = 1;
+	/* The trie. Nothing leads back to the root in it, so 0 can stand for no child */
+	for(long i = 0; i < table->num_pairs; i++)
+	{
+		int state = 0;
+		for(long j = 0; j < table->pairs[i].find_length; j++)
+		{
+			int *child = &table->next[state * num_classes + table->classes[(unsigned char)text[table->pairs[i].find + j]]];
+			if(!*child)
+			{
+				*child = table->num_states++;
+				table->depth[*child] = j + 1;
+				table->match[*child] = -1;
+			}
+			state = *child;
+		}
+		if(table->match[state] < 0)
+			table->match[state] = i;
+	}
+	long head = 0, tail = 0;
+	for(c = 0; c < num_classes; c++)
+	{
+		int child = table->next[c];
+		if(child)
+		{
+			fail[child] = 0;
+			queue[tail++] = child;
+		}
+	}
+	while(head < tail)
+	{
+		int state = queue[head++];
+		int *next = &table->next[state * num_classes];
+		int *fail_next = &table->next[fail[state] * num_classes];
+		if(table->match[state] < 0)
+			table->match[state] = table->match[fail[state]];
+		for(c = 0; c < num_classes; c++)
+		{
+			if(next[c])
+			{
+				fail[next[c]] = fail_next[c];
+				queue[tail++] = next[c];
+			}
+			else
+				next[c] = fail_next[c];
+		}
+	}
+	mem_free(fail, MEM_OTHER);
+	mem_free(queue, MEM_OTHER);
+}
+long substitute_table(struct replace_table *table, long start, long end, long num, struct state_spec *state)
+/* Implements SUBSTITUTE:T, making the replacements of a table in the lines from start to end in one pass over each line, however many pairs
+   the table has. Where old strings overlap, the one starting first is replaced, and of those starting at the same place, the longest. The
+   automaton is run until no string it might still be in the middle of could start as early as the best match found, so that match is final */
+{
+	long num_subs = 0;
+	for(long line = start; line <= end && (num < 0 || num_subs < num); line++)
+	{
+		struct string *old_str = get_line(line, state);
+		struct string *new_str = NULL;
+		unsigned char *text = (unsigned char *)old_str->buf;
+		long copied = 0;
+		long best = -1, best_start = 0, best_end = 0;
+		int at = 0;
+		for(long i = 0; i <= old_str->length; i++)
+		{
+			if(i < old_str->length)
+			{
+				at = table->next[at * table->num_classes + table->classes[text[i]]];
+				int found = table->match[at];
+				if(found >= 0 && (best < 0 || i + 1 - table->pairs[found].find_length <= best_start))
+				{
+					best = found;
+					best_end = i + 1;
+					best_start = best_end - table->pairs[found].find_length;
+				}
+				if(best < 0 || best_start >= i + 1 - table->depth[at])
+					continue;
+			}
+			else if(best < 0)
+				break;
+			struct replace_pair *pair = &table->pairs[best];
+			if(!new_str)
+				new_str = string_with_capacity(NULL, old_str->length);
+			cat_slice(new_str, old_str, copied, best_start - copied);
+			cat_slice(new_str, &table->text, pair->replace, pair->replace_length);
+			copied = best_end;
+			pair->count++;
+			best = -1;
 			num_subs++;
-			made_sub = 1;
+			if(num >= 0 && num_subs >= num)
+				break;
+			/* Go back to just after the match, forgetting the strings the automaton was part way through */
+			i = best_end - 1;
+			at = 0;
 		}
-		if(made_sub && (mode == 'L' || mode == 'V'))
+		if(new_str)
 		{
-			print_string(&state->main_buffer[line]);
+			cat_slice(new_str, old_str, copied, -1);
+			delete_string(&state->main_buffer[line]);
+			state->main_buffer[line] = *intern_string(new_str);
+			mem_free(new_str, MEM_STRINGS);
+			lines_changed(state, line, 1, 1);
 		}
 	}
 	return num_subs;
 }
+void report_table(struct replace_table *table)
+/* Types how many replacements were made with each pair of a table, next to the pair as it was written */
+{
+	for(long i = 0; i < table->num_pairs; i++)
+	{
+		fprintf(term_out, "%li ", table->pairs[i].count);
+		print_slice(table->text.buf + table->pairs[i].line, table->pairs[i].line_length);
+		fprintf(term_out, "\r\n");
+	}
+}
+void free_table(struct replace_table *table)
+{
+	delete_string(&table->text);
+	mem_free(table->pairs, MEM_OTHER);
+	mem_free(table->next, MEM_OTHER);
+	mem_free(table->depth, MEM_OTHER);
+	mem_free(table->match, MEM_OTHER);
+	mem_free(table, MEM_OTHER);
+}
 char convert_esc(char c, struct state_spec *state)
 /* Converts one or more characters for response and printing.  Capitalizes and turns relevant multi-character escape sequences into single command characters */
 {
@@ -373,23 +3058,10 @@ char convert_esc(char c, struct state_spec *state)
 	}
 	return c;
 }
-void free_line_spec(struct line_spec *ls)
-/* Frees the line spec ls and recursively frees any dependent line specs */
-{
-	if(ls->next)
-	{
-		free_line_spec(ls->next);
-	}
-	if(ls->search.buf)
-	{
-		delete_string(&ls->search);
-	}
-	free(ls);
-}
-struct line_spec *new_line_spec(char sign, char type, int line, struct string *search)
-/* Constructor for line specifiers */
+struct line_spec *new_line_spec(char sign, char type, long line, struct string *search)
+/* Constructor for line specifiers, which are allocated from the parser arena along with the rest of the command */
 {
-	struct line_spec *ls = malloc(sizeof(struct line_spec));
+	struct line_spec *ls = arena_alloc(&parser_arena, sizeof(struct line_spec));
 	ls->sign = sign;
 	ls->type = type;
 	ls->line=line;
@@ -398,75 +3070,111 @@ struct line_spec *new_line_spec(char sign, char type, int line, struct string *s
 	return ls;
 }
 void free_command_spec(struct command_spec *cmd)
-/* Frees the command_spec cmd and its dependent line_specs, if any */
+/* Frees the command_spec cmd along with its line_specs and strings, by resetting the parser arena they were all allocated from */
 {
-	if(cmd->start)
-	{
-		free_line_spec(cmd->start);
-	}
-	if(cmd->end)
-	{
-		free_line_spec(cmd->end);
-	}
-	if(cmd->arg1.buf)
-	{
-		delete_string(&cmd->arg1);
-	}
-	if(cmd->arg2.buf)
-	{
-		delete_string(&cmd->arg2);
-	}
-	free(cmd);
+	(void)cmd;  /* The arena owns the command, so there is nothing to free through it; callers still name the command they are done with */
+	reset_arena(&parser_arena);
 }
 void free_buffer_stack(struct buffer_pos *stack)
 {
 	if(stack)
 	{
 		free_buffer_stack(stack->prev);
-		free(stack);
+		mem_free(stack, MEM_STACK);
 	}
 }
 void free_state_spec(struct state_spec *state)
 {
-	for(int i = 0; i <= state->dollar; i++)
+	for(long i = 0; i <= state->dollar; i++)
 	{
 		delete_string(&state->main_buffer[i]);
 	}
-	free(state->main_buffer);
+	mem_free(state->main_buffer, MEM_LINES);
 	for(int i = 0; i < NUM_AUX_BUFS; i++)
 	{
-		delete_string(&state->aux_buffers[i]);
+		kill_buffer(i, state);
 	}
-	free(state->aux_buffers);
+	mem_free(state->aux_buffers, MEM_OTHER);
+	mem_free(state->aux_spans, MEM_OTHER);
+	delete_string(&state->paste);
+	for(int i = 0; state->searches && i < SEARCH_CACHE; i++)
+	{
+		delete_string(&state->searches[i].search);
+		mem_free(state->searches[i].matches, MEM_OTHER);
+		free_pattern(state->searches[i].pattern);
+	}
+	mem_free(state->searches, MEM_OTHER);
+	free_source(state->source);
 	if (state->file)
 		free(state->file);
 	free_buffer_stack(state->buffer_stack);
-	free(state);
+	mem_free(state, MEM_OTHER);
 }
 char print_char(char c)
 /* Prints the character c, converting it for printability as necessary (e.g. CR becomes CRLF, ^A becomes &A). Returns the char back so the caller can check for \0 */
 {
+	if(quiet)
+		return c;
 	if(c == '\r' || c == '\n')
-		printf("\r\n");
+		fprintf(term_out, "\r\n");
 	else if(c && c <= (char)26 && c != '\t')	/* c is a control character */
 	{
-		putchar_unlocked((int)'&');
-		putchar_unlocked((int)(c+'A'-1));
+		putc_unlocked((int)'&', term_out);
+		putc_unlocked((int)(c+'A'-1), term_out);
 	}
 	else
-		putchar_unlocked((int)c);
+		putc_unlocked((int)c, term_out);
 	return c;
 }
 int print_buffer(char *buf)
-/* Print a string using the print_char function */
+/* Print a string, converting it as print_char does */
 {
 	if(!buf)
 		return 0;
-	for(;*buf;buf++)
+	print_slice(buf, strlen(buf));
+	return 1;
+}
+void print_slice(char *text, long length)
+/* Prints the first length characters of text as print_char would, a block at a time. The terminal's output is unbuffered, so going through print_char would take a write for every character of a long line */
+{
+	char block[4096];
+	long used = 0;
+	if(quiet)
+		return;
+	for(long i = 0; i < length; i++)
 	{
-		print_char(*buf);
+		char c = text[i];
+		if(used > (long)sizeof(block) - 2)
+		{
+			fwrite(block, 1, used, term_out);
+			used = 0;
+		}
+		if(c == '\r' || c == '\n')
+		{
+			block[used++] = '\r';
+			block[used++] = '\n';
+		}
+		else if(c && c <= (char)26 && c != '\t')
+		{
+			block[used++] = '&';
+			block[used++] = c+'A'-1;
+		}
+		else
+			block[used++] = c;
 	}
-	return 1;
+	fwrite(block, 1, used, term_out);
+}
+void echo_text(const char *text)
+/* Types text back as part of the echo of what was typed, unless the echo is off */
+{
+	if(!quiet)
+		fputs(text, term_out);
+}
+void echo_char(char c)
+/* Types c back as echo_text does, as it is */
+{
+	if(!quiet)
+		putc_unlocked((int)c, term_out);
 }
 int next_char(char *c, int convert, int echo, int ctl_v, struct state_spec *state)
 /* Read the next character from file, buffer, or stdin. Used when reading into a buffer of any kind, such as APPEND/INSERT/CHANGE, EDIT/MODIFY, JAM INTO, and searches/SUBSTITUTE */
@@ -478,49 +3186,50 @@ int next_char(char *c, int convert, int echo, int ctl_v, struct state_spec *stat
 	}
 	else if(state->buffer_stack)
 	{
-		//printf("(bufferstack %i)", state->buffer_stack->buf_num); //DEBUG
+		//fprintf(term_out, "(bufferstack %i)", state->buffer_stack->buf_num); //DEBUG
 		while(1)
 		{
 			struct buffer_pos *current_pos = state->buffer_stack;
+			struct string *buffer = aux_buffer(current_pos->buf_num, state);
 			current_pos->current_char++;
-			if(current_pos->current_char < state->aux_buffers[current_pos->buf_num].length)	/* We're still inside the buffer, just grab the next char */
+			if(current_pos->current_char < buffer->length)	/* We're still inside the buffer, just grab the next char */
 			{
-				status = state->aux_buffers[current_pos->buf_num].buf[current_pos->current_char];
-				//printf("[0x%x]", status); //DEBUG
+				status = buffer->buf[current_pos->current_char];
+				//fprintf(term_out, "[0x%x]", status); //DEBUG
 				break;
 			}
-			else if(current_pos->current_char > state->aux_buffers[current_pos->buf_num].length)
+			else if(current_pos->current_char > buffer->length)
 				return 0;
 			state->buffer_stack = current_pos->prev;
-			free(current_pos);
+			mem_free(current_pos, MEM_STACK);
 			if(!(state->buffer_stack))
 			{
-				status = (char)getchar_unlocked();
+				status = (char)read_byte();
 				break;
 			}
 		}
 	}
 	else
 	{
-		status = (char)getchar_unlocked();
+		status = (char)read_byte();
 	}
 	if(!status || status == EOF)
 		return 0;
 	if(status == 0x02 && !ctl_v && !state->file)	/* CTL-B; execute buffer */
 	{
 		char b;
-		printf("#");
+		echo_text("#");
 		next_char(&b, 0, 1, 1, state);
 		int buf_num = buffer_for_char(toupper(b));
 		if(buf_num == -1)
 		{
-			printf("?");
+			echo_text("?");
 			*c = '\0';
 			return next_char(c, convert, echo, 0, state);
 		}
-		if(state->aux_buffers[buf_num].length)
+		if(aux_buffer(buf_num, state)->length)
 		{
-			struct buffer_pos *new_pos = malloc(sizeof(struct buffer_pos));
+			struct buffer_pos *new_pos = mem_alloc(sizeof(struct buffer_pos), MEM_STACK);
 			new_pos->current_char = -1;
 			new_pos->buf_num = buf_num;
 			new_pos->prev = state->buffer_stack;
@@ -534,17 +3243,132 @@ int next_char(char *c, int convert, int echo, int ctl_v, struct state_spec *stat
 	if(convert)
 		*c = convert_esc(*c, state);
 	if(echo)
-		putchar_unlocked((int)*c);
+		echo_char(*c);
 	return status;
 }
-void **replace_elements_in_vector(void **dest, int *dest_length, void **src, int src_length, int pos, int num)
-/* Inserts all of the items from src into dest at position pos, replacing num of dest's existing items. All replaced items are freed. Dest keeps the items from src and src itself is freed. dest_length should point to dest's length, and this will be set to the length of the new dest. The new dest is returned. */
+int read_byte()
+/* Reads the next byte typed at the terminal, or by the client or program running commands when scripted. Everything qed reads from the terminal comes through here, so that
+   sessions can be recorded and replayed: while a recording is being replayed its keystrokes are taken in place of the terminal's, until it runs out */
+{
+	int c;
+	if(session.replay && term_in == stdin)
+	{
+		long when = read_number(session.replay);
+		if((c = getc(session.replay)) != EOF)
+		{
+			long wait = when - (microseconds() - session.start);
+			if(session.paced && wait > 0)
+				nanosleep(&(struct timespec){wait / 1000000, wait % 1000000 * 1000}, NULL);
+			session.keys++;
+			return c;
+		}
+		report_replay();
+	}
+	c = getc_unlocked(term_in);
+	if(session.record && term_in == stdin && c != EOF)
+	{
+		write_number(microseconds() - session.start, session.record);
+		putc(c, session.record);
+	}
+	return c;
+}
+long microseconds()
+/* Returns the time in microseconds, for timing sessions; only the difference between two of these means anything */
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+void report_replay()
+/* Ends the replay of a recorded session, printing how long it took, how long its commands took, and how much memory is in use */
+{
+	struct mallinfo2 heap = mallinfo2();
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	fprintf(term_out, "\r\nREPLAYED %li KEYS IN %.3f SECONDS.\r\n", session.keys, (microseconds() - session.start) / 1e6);
+	fprintf(term_out, "%li COMMANDS TOOK %.3f SECONDS, THE SLOWEST %.3f.\r\n", session.commands, session.command_time / 1e6, session.slowest / 1e6);
+	fprintf(term_out, "%zu BYTES OF HEAP IN USE, %li KB PEAK RESIDENT.\r\n", heap.uordblks + heap.hblkhd, usage.ru_maxrss);
+	if(session.commands)
+		fprintf(term_out, "%.2f ALLOCATIONS PER COMMAND, %.2f OF THEM WHILE READING IT.\r\n", (double)session.allocations / session.commands, (double)session.parse_allocations / session.commands);
+	fclose(session.replay);
+	session.replay = NULL;
+}
+void report_heap(struct state_spec *state)
+/* Executes the HEAP command, showing how much memory each subsystem has and how many blocks it is in, then how much of the heap malloc is holding on to */
+{
+	struct mallinfo2 heap = mallinfo2();
+	long total = 0, blocks = 0, aux = 0;
+	for(int i = 0; i < NUM_AUX_BUFS; i++)
+	{
+		if(state->aux_buffers[i].buf)
+			aux += malloc_usable_size(state->aux_buffers[i].buf);
+	}
+	fprintf(term_out, "%-14s%14s%10s%14s\r\n", "", "BYTES", "BLOCKS", "PEAK");
+	for(int i = 0; i < 7; i++)
+	{
+		fprintf(term_out, "%-14s%14li%10li%14li\r\n", mem_names[i], memory[i].bytes, memory[i].blocks, memory[i].peak);
+		total += memory[i].bytes;
+		blocks += memory[i].blocks;
+	}
+	fprintf(term_out, "%-14s%14li%10li\r\n", "TOTAL", total, blocks);
+	fprintf(term_out, "%li BYTES OF STRINGS ARE IN AUX BUFFERS.\r\n", aux);
+	fprintf(term_out, "MALLOC HOLDS %zu BYTES, %zu OF THEM FREE. %li KB RESIDENT.\r\n", heap.arena + heap.hblkhd, heap.fordblks, resident_kb());
+}
+void yield_memory(struct state_spec *state)
+/* Executes the YIELD command. Trims the spare space off the ends of strings, drops the cache of unpacked pages and shrinks the intern table if lines have been deleted from it,
+   then has malloc give the freed memory back to the system */
+{
+	long before = resident_kb();
+	long trimmed = 0;
+	for(int i = 0; i <= NUM_AUX_BUFS; i++)
+	{
+		struct string *s = i < NUM_AUX_BUFS?&state->aux_buffers[i]:&state->paste;
+		if(s->buf && s->space > s->length)
+		{
+			trimmed += s->space - s->length;
+			s->buf = mem_realloc(s->buf, s->length+1, MEM_STRINGS);
+			s->space = s->length;
+		}
+	}
+	for(int i = 0; pager.cache && i < PACK_CACHE; i++)
+	{
+		if(pager.cache[i].text)
+			trimmed += pager.packed[pager.cache[i].page].length;
+		mem_free(pager.cache[i].text, MEM_PAGER);
+		pager.cache[i].text = NULL;
+		pager.cache[i].page = -1;
+	}
+	if(line_pool.num_buckets > INTERN_BUCKETS && line_pool.count < line_pool.num_buckets/4)
+	{
+		long num_buckets = line_pool.num_buckets;
+		while(num_buckets > INTERN_BUCKETS && line_pool.count < num_buckets/2)
+			num_buckets /= 2;
+		trimmed += (line_pool.num_buckets - num_buckets) * sizeof(struct line_text *);
+		resize_intern_table(num_buckets);
+	}
+	malloc_trim(0);
+	fprintf(term_out, "%li BYTES TRIMMED, %li KB RESIDENT (WAS %li KB).\r\n", trimmed, resident_kb(), before);
+}
+long resident_kb()
+/* Returns how much of qed is resident in memory right now, in KB */
 {
-	int i, new_length;
+	long size = 0, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if(!statm)
+		return 0;
+	if(fscanf(statm, "%li %li", &size, &resident) != 2)
+		resident = 0;
+	fclose(statm);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+void **replace_elements_in_vector(void **dest, long *dest_length, void **src, long src_length, long pos, long num)
+/* Inserts all of the items from src into dest at position pos, replacing num of dest's existing items. All replaced items are freed. The vectors and items are charged to MEM_LINES, like the main buffer's. Dest keeps the items from src and src itself is freed. dest_length should point to dest's length, and this will be set to the length of the new dest. The new dest is returned. */
+{
+	long i, new_length;
 	new_length = *dest_length - num + src_length;
 	if(num < src_length)
 	{
-		dest = realloc(dest, new_length * sizeof(void**));
+		dest = mem_realloc(dest, new_length * sizeof(void**), MEM_LINES);
 		for(i = *dest_length-1; i >= pos+num; i--)
 		{
 			dest[i+new_length-*dest_length] = dest[i];
@@ -555,29 +3379,29 @@ void **replace_elements_in_vector(void **dest, int *dest_length, void **src, int
 		for(i = pos+src_length; i < new_length; i++)
 		{
 			if(i < pos+num)
-				free(dest[i]);
+				mem_free(dest[i], MEM_LINES);
 			dest[i] = dest[i+*dest_length-new_length];
 		}
-		dest = realloc(dest, new_length * sizeof(void**));
+		dest = mem_realloc(dest, new_length * sizeof(void**), MEM_LINES);
 	}
 	for(i = 0; i < src_length; i++)
 	{
 		if(i < num)
-			free(dest[i+pos]);
+			mem_free(dest[i+pos], MEM_LINES);
 		dest[i+pos] = src[i];
 	}
-	free(src);
+	mem_free(src, MEM_LINES);
 	*dest_length = new_length;
 	return dest;
 }
-struct string *replace_elements_in_string_vector(struct string *dest, int *dest_length, struct string *src, int src_length, int pos, int num)
+struct string *replace_elements_in_string_vector(struct string *dest, long *dest_length, struct string *src, long src_length, long pos, long num)
 /* Inserts all of the strings from src into dest at position pos, replacing num of dest's existing strings. All replaced strings are freed. Dest keeps the strings from src and src itself should be freed by the caller after. dest_length should point to dest's length, and this will be set to the length of the new dest. The new dest is returned. */
 {
-	int i, new_length;
+	long i, new_length;
 	new_length = *dest_length - num + src_length;
 	if(num < src_length)  /* We are adding more than we are replacing */
 	{
-		dest = realloc(dest, new_length * sizeof(struct string));
+		dest = mem_realloc(dest, new_length * sizeof(struct string), MEM_LINES);
 		for(i = *dest_length-1; i >= pos+num; i--)
 		{
 			dest[i+new_length-*dest_length] = dest[i];
@@ -585,22 +3409,154 @@ struct string *replace_elements_in_string_vector(struct string *dest, int *dest_
 	}
 	else if(num > src_length)  /* We are adding fewer elements than we are replacing */
 	{
+		for(i = pos+src_length; i < pos+num; i++)
+			delete_string(&dest[i]);
 		for(i = pos+src_length; i < new_length; i++)
-		{
-			if(i < pos+num)
-				delete_string(&dest[i]);
 			dest[i] = dest[i+*dest_length-new_length];
-		}
-		dest = realloc(dest, new_length * sizeof(struct string));
+		dest = mem_realloc(dest, new_length * sizeof(struct string), MEM_LINES);
 	}
 	for(i = 0; i < src_length; i++)
 	{
-		if(i < num)
-			delete_string(&dest[i+pos]);
-		dest[i+pos] = src[i];
+		if(i < num)
+			delete_string(&dest[i+pos]);
+		dest[i+pos] = src[i];
+	}
+	*dest_length = new_length;
+	return dest;
+}
+void *mem_alloc(size_t size, int subsystem)
+/* malloc, charging the block to the given subsystem. It must be freed with mem_free (or resized with mem_realloc) giving the same subsystem */
+{
+	void *p = malloc(size);
+	if(p)
+		mem_count(subsystem, malloc_usable_size(p), 1);
+	return p;
+}
+void *mem_calloc(size_t num, size_t size, int subsystem)
+/* calloc, charging the block to the given subsystem */
+{
+	void *p = calloc(num, size);
+	if(p)
+		mem_count(subsystem, malloc_usable_size(p), 1);
+	return p;
+}
+void *mem_realloc(void *p, size_t size, int subsystem)
+/* realloc of a block charged to the given subsystem, or of NULL to allocate a new one */
+{
+	long old_size = p?malloc_usable_size(p):0;
+	void *new_p = realloc(p, size);
+	if(!new_p && size)
+		return NULL;
+	if(p)
+		mem_count(subsystem, -old_size, -1);
+	if(new_p)
+		mem_count(subsystem, malloc_usable_size(new_p), 1);
+	return new_p;
+}
+void mem_free(void *p, int subsystem)
+/* free of a block charged to the given subsystem */
+{
+	if(!p)
+		return;
+	mem_count(subsystem, -(long)malloc_usable_size(p), -1);
+	free(p);
+}
+void mem_count(int subsystem, long bytes, long blocks)
+/* Adds bytes and blocks to what is charged to the subsystem. The loading and unpacking threads allocate too, so the counts are updated atomically */
+{
+	struct mem_account *account = &memory[subsystem];
+	long total = __atomic_add_fetch(&account->bytes, bytes, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&account->blocks, blocks, __ATOMIC_RELAXED);
+	if(blocks > 0)
+		__atomic_add_fetch(&account->made, blocks, __ATOMIC_RELAXED);
+	if(total > __atomic_load_n(&account->peak, __ATOMIC_RELAXED))
+		__atomic_store_n(&account->peak, total, __ATOMIC_RELAXED);
+}
+long allocations_made()
+/* The number of allocations made so far by all subsystems together */
+{
+	long made = 0;
+	for(int i = 0; i < 7; i++)
+		made += __atomic_load_n(&memory[i].made, __ATOMIC_RELAXED);
+	return made;
+}
+void *arena_alloc(struct arena *a, long size)
+/* Returns size bytes from the arena a, aligned like malloc's. A block is only taken from the heap if none of those the arena already has is free and big enough */
+{
+	size = (size + 15) & ~15L;
+	if(!a->current || a->used + size > a->current->size)
+	{
+		struct arena_block *block = a->current?a->current->next:NULL;
+		while(block && block->size < size)
+			block = block->next;
+		if(!block)
+		{
+			long block_size = size > ARENA_BLOCK?size:ARENA_BLOCK;
+			block = mem_alloc(sizeof(struct arena_block) + block_size, MEM_PARSER);
+			block->next = NULL;
+			block->size = block_size;
+			if(!a->first)
+				a->first = block;
+			else
+			{
+				struct arena_block *tail = a->current;
+				while(tail->next)
+					tail = tail->next;
+				tail->next = block;
+			}
+		}
+		a->current = block;
+		a->used = 0;
+	}
+	a->last = a->current->data + a->used;
+	a->used += size;
+	return a->last;
+}
+void *arena_grow(struct arena *a, void *p, long old_size, long size)
+/* Resizes p, an allocation of old_size bytes from the arena a, to size bytes. This happens in place if p was the last allocation and its block has room; otherwise p is copied to a new allocation. Returns where it is now */
+{
+	if(p == a->last)
+	{
+		long end = a->last - a->current->data + ((size + 15) & ~15L);
+		if(end <= a->current->size)
+		{
+			a->used = end;
+			return p;
+		}
+	}
+	void *new_p = arena_alloc(a, size);
+	memcpy(new_p, p, old_size < size?old_size:size);
+	return new_p;
+}
+int in_arena(struct arena *a, void *p)
+/* Returns whether p points into one of the blocks of the arena a */
+{
+	for(struct arena_block *block = a->first; block; block = block->next)
+	{
+		if((char *)p >= block->data && (char *)p < block->data + block->size)
+			return 1;
+	}
+	return 0;
+}
+void reset_arena(struct arena *a)
+/* Frees everything allocated from the arena a at once, keeping its blocks to be allocated from again */
+{
+	a->current = a->first;
+	a->used = 0;
+	a->last = NULL;
+}
+void free_arena(struct arena *a)
+/* Gives the blocks of the arena a back to the heap */
+{
+	while(a->first)
+	{
+		struct arena_block *next = a->first->next;
+		mem_free(a->first, MEM_PARSER);
+		a->first = next;
 	}
-	*dest_length = new_length;
-	return dest;
+	a->current = NULL;
+	a->used = 0;
+	a->last = NULL;
 }
 void add_char_to_string(struct string *str, char c, int reallocate, int echo, int skip, struct string *lbuf)
 /* Adds the character c to the string str. If unlimited is true, the buffer will be reallocated if needed to make room for the new character; otherwise characters past the end are silently dropped. */
@@ -617,8 +3573,7 @@ void add_char_to_string(struct string *str, char c, int reallocate, int echo, in
 	{
 		if(reallocate)
 		{
-			str->space += BUF_INCREMENT;
-			str->buf = realloc(str->buf, str->space+1);
+			reserve_space(str, (str->space == SHARED?str->length:str->space) + BUF_INCREMENT);
 			str->buf[str->length] = c;
 			str->length ++;
 			if(c != 0x04 && echo)
@@ -633,6 +3588,34 @@ void add_char_to_string(struct string *str, char c, int reallocate, int echo, in
 			print_char(c);
 	}
 }
+void add_slice_to_string(struct string *str, char *text, long length, int reallocate, int echo, int skip, struct string *lbuf)
+/* Adds the first length characters of text to str all at once, just as that many calls to add_char_to_string would, for copying the rest of the old line in EDIT/MODIFY */
+{
+	long added = length;
+	if(lbuf)
+		add_slice_to_string(lbuf, text, length, 1, 0, 0, NULL);
+	if(!skip)
+	{
+		if(str->length + length > str->space)
+		{
+			if(reallocate)
+				reserve_space(str, str->length + length);
+			else
+				added = str->space > str->length?str->space - str->length:0;
+		}
+		memcpy(str->buf + str->length, text, added);
+		str->length += added;
+	}
+	/* Echoed as add_char_to_string would, leaving out any ^D */
+	for(char *p = text, *end = text + (skip?length:added); echo && p < end; )
+	{
+		char *stop = memchr(p, 0x04, end - p);
+		if(!stop)
+			stop = end;
+		print_slice(p, stop - p);
+		p = stop + 1;
+	}
+}
 char get_flags(struct command_spec *command, struct state_spec *state)
 /* Called when we're expecting flags for the SUBSTITUTE command; reads them in and sets the flag member variable in the command spec */
 {
@@ -642,7 +3625,7 @@ char get_flags(struct command_spec *command, struct state_spec *state)
 	} while(c == ' ' || c == '\t');
 	while(c == ':')
 	{
-		int n = 0;
+		long n = 0;
 		int digit = 0;
 		next_char(&c, 1, 0, 0, state);
 		while(c >= '0' && c <= '9')
@@ -655,9 +3638,9 @@ char get_flags(struct command_spec *command, struct state_spec *state)
 		}
 		if(!digit)
 		{
-			if(c == 'G' || c == 'W' || c == 'L' || c == 'V')
+			if(c == 'G' || c == 'W' || c == 'L' || c == 'V' || c == 'T')
 			{
-				printf("%c",c);
+				echo_char(c);
 				command->flag = c;
 				do{
 					next_char(&c, 1, 1, 0, state);
@@ -682,18 +3665,126 @@ void get_buffer_name(struct command_spec *command, struct state_spec *state)
 	next_char(&c, 1, 0, 0, state);
 	if((c>= '0' && c <= '9') || (c >= 'A' && c <= 'Z'))
 	{
-		printf("%c",c);
+		echo_char(c);
 		string_from_cstring(&command->arg1, " ");
 		command->arg1.buf[0] = c;
 	}
 }
-void finish_l_buffer(struct string **ctrl_l_buffer, struct state_spec *state)
+int get_substitution(struct command_spec *command, struct state_spec *state)
+/* Called when we're expecting the flags and strings of a SUBSTITUTE, as in S:G/new/old/. Reads them into the command spec; returns 0 if they're no good.
+   With :T there is a table of pairs instead of the strings, read from the aux buffer named next, which goes in arg1, as in S:TA, or from the file
+   named next, which goes in arg2, delimited like the file name in READ FROM, as in S:T/renames/ */
+{
+	char c = get_flags(command, state);
+	if(!c)
+		return 0;
+	if(command->flag == 'T')
+	{
+		if((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z'))
+		{
+			string_from_cstring(&command->arg1, " ");
+			command->arg1.buf[0] = c;
+			return 1;
+		}
+		get_string(&(command->arg2), c, 0, 1, 0, 1, NULL, state);
+		return command->arg2.length != 0;
+	}
+	get_string(&(command->arg1), c, 0, 1, 0, 1, NULL, state);
+	if (!state->quick)
+	{
+		echo_text(" FOR ");
+		print_char(c);
+	}
+	get_string(&(command->arg2), c, 0, 1, 0, 1, NULL, state);
+	return command->arg2.length != 0;
+}
+int get_every(struct command_spec *command, struct state_spec *state)
+/* Called when we're expecting the pattern and subcommand of EVERY, as in EVERY /foo/ DELETE. The pattern goes in arg1, delimited like the file name in READ FROM,
+   and the subcommand in a command spec of its own in sub: DELETE, PRINT, SUBSTITUTE, or a buffer call. Returns 0 if they're no good */
+{
+	char c;
+	do
+	{
+		next_char(&c, 0, 1, 0, state);
+	} while(c == ' ' || c == '\t' || c == '\n');
+	get_string(&(command->arg1), c, 0, 1, 0, 1, NULL, state);
+	if(command->arg1.length == 0)
+		return 0;
+	/* The ^B of a buffer call is read as it is rather than acted on */
+	do
+	{
+		next_char(&c, 1, 0, 1, state);
+	} while(c == ' ' || c == '\t');
+	if(!state->quick)
+		echo_text(" ");
+	struct command_spec *sub = command->sub = new_command_spec();
+	sub->command = c;
+	if(c == 0x02)
+	{
+		echo_text("#");
+		get_buffer_name(sub, state);
+		return sub->arg1.buf != NULL;
+	}
+	if(c != 'D' && c != 'P' && c != 'S')
+		return 0;
+	echo_text(cmd_strings[strchr(cmd_chars, c) - cmd_chars]);
+	return c != 'S' || get_substitution(sub, state);
+}
+int get_notation(struct command_spec *command, struct state_spec *state)
+/* Called when we're expecting which notation NOTATION is to switch to, P for PATTERNS or L for LITERAL, as in NOTATION PATTERNS. (typed NP.).
+   Sets the flag member of the command spec to it; returns 0 if it's neither */
+{
+	char c;
+	do{
+		next_char(&c, 1, 0, 0, state);
+	} while(c == ' ' || c == '\t');
+	if(c != 'P' && c != 'L')
+		return 0;
+	command->flag = c;
+	if(state->quick)
+		print_char(c);
+	else
+		echo_text(c == 'P'?"PATTERNS":"LITERAL");
+	return 1;
+}
+int get_order(struct command_spec *command, struct state_spec *state)
+/* Called when we're expecting the options of ORDER, any of :R (reverse), :N (numeric) and :U (unique), as in ORDER:N:R., up to and including the
+   confirming . Sets the num member of the command spec to the options given; returns 0 if any of them is no good */
+{
+	char c;
+	command->num = 0;
+	do{
+		next_char(&c, 1, 0, 0, state);
+	} while(c == ' ' || c == '\t');
+	while(c == ':')
+	{
+		print_char(c);
+		next_char(&c, 1, 0, 0, state);
+		if(c == 'R')
+			command->num |= ORDER_REVERSE;
+		else if(c == 'N')
+			command->num |= ORDER_NUMERIC;
+		else if(c == 'U')
+			command->num |= ORDER_UNIQUE;
+		else
+			return 0;
+		print_char(c);
+		do{
+			next_char(&c, 1, 0, 0, state);
+		} while(c == ' ' || c == '\t');
+	}
+	if(c != '.')
+		return 0;
+	print_char(c);
+	return 1;
+}
+static void finish_l_buffer(struct string **ctrl_l_buffer, struct state_spec *state)
 {
 	if ((*ctrl_l_buffer)->buf[(*ctrl_l_buffer)->length-1] == 0x04)
 		(*ctrl_l_buffer)->length--;
 	(*ctrl_l_buffer)->buf[(*ctrl_l_buffer)->length] = 0;
 	set_buffer(1, (*ctrl_l_buffer), state);
-	free((*ctrl_l_buffer));
+	free_string((*ctrl_l_buffer));
 	(*ctrl_l_buffer) = NULL;
 }
 int get_string(struct string *str, char delim, int full, int unlimited, int literal, int oneline, struct string *oldline, struct state_spec *state)
@@ -702,16 +3793,31 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 	char c;  /* Holds the most recent character read from the input source (user, buffer, file) */
 	int stop = 0;  /* Set to 1 if we're done with this line and should return it */
 	int status;  /* Status of the last call to next_char, indicating whether a character was successfully gotten. Will be 0 if we've reached the end of the file or buffer we're taking input from */
-	int oldpos = 0;  /* Cursor position in the old line */
+	long oldpos = 0;  /* Cursor position in the old line */
 	int insert = 0;  /* Whether insert mode is on, causing typed characters to be inserted in EDIT/MODIFY rather than overwriting the old line */
 	int skip_mode = 0;  /* Ctrl-K mode where no chars are added */
 	struct string *ctrl_l_buffer = NULL;  /* Special buffer for the Ctrl-L command */
-	struct string *refline = oldline?copy_string(NULL, oldline, 0):new_string();
+	int tab_spaces = 0;  /* Spaces still to be typed for a tab */
+	int held = 0;  /* Set when c was read while looking for the start of a paste but turned out not to be part of it, and still has to be taken */
+	struct string reference = {0, 0, {NULL}};  /* The old line, or the line last finished with Ctrl-Y */
+	struct string *refline = oldline?share_string(&reference, oldline):&reference;
 	empty_string(str);
-	do
+	if(state->paste.buf && full && oneline && !literal && !oldline)
+		stop = get_pasted_line(str, state);
+	while(!stop)
 	{
 		//dbg_string(str);
-		status = next_char(&c, 0, 0, 0, state);
+		if(tab_spaces)
+		{
+			/* Type the spaces a tab expands to as if they had been typed one by one */
+			c = ' ';
+			tab_spaces--;
+			status = 1;
+		}
+		else if(held)
+			held = 0;
+		else
+			status = next_char(&c, 0, 0, 0, state);
 		if(!status)
 		{
 			stop = 1;
@@ -724,6 +3830,18 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 		}
 		else
 		{
+			if(c == '\t')	/* Ctrl-I (Tab) */
+			{
+				long column = line_column(str);
+				tab_spaces = column < TAB_COLUMNS?state->tabs[column]:0;
+				if(!tab_spaces)
+				{
+					echo_char(7);	/* Ring bell; there are no more tab stops */
+					continue;
+				}
+				c = ' ';
+				tab_spaces--;
+			}
 			switch(c)
 			{
 				case 0x01:	/* Ctrl-A (Delete Character) */
@@ -731,14 +3849,14 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 					{
 						str->length --;
 					}
-					printf("%s", up_arrow);
+					echo_text(up_arrow);
 					if(!(str->length))
 					{
-						printf("\r\n");
+						echo_text("\r\n");
 					}
 					break;
 				case 0x17:	/* Ctrl-W (Delete Word) */
-					printf("\\");
+					echo_text("\\");
 					/* Delete any spaces at the end of the string */
 					while((str->length)&&((str->buf)[str->length-1] == ' '||(str->buf)[str->length-1] == '\t'))
 					{
@@ -751,11 +3869,12 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 					}
 					if(!(str->length))
 					{
-						printf("\r\n");
+						echo_text("\r\n");
 					}
 					break;
 				case 0x11:	/* Ctrl-Q (Delete Line) */
-					printf("%s\r\n",left_arrow);
+					echo_text(left_arrow);
+					echo_text("\r\n");
 					str->length = 0;
 					oldpos = 0;
 					break;
@@ -766,48 +3885,77 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 				case 0x0c:     /* Ctrl-L (special buffer) */
 					if (ctrl_l_buffer)
 					{
-						printf("]");
+						echo_text("]");
 						finish_l_buffer(&ctrl_l_buffer, state);
 					}
 					else
 					{
-						printf("[");
+						echo_text("[");
 						kill_buffer(1, state);
 						ctrl_l_buffer = empty_string(NULL);
 					}
 					break;
 				case 0x0b:  /* Ctrl-K mode; no chars added */
-					printf("\"");
+					echo_text("\"");
 					skip_mode = !skip_mode;
 					break;
+				case 0x1B:  /* Escape; when typing new lines, this may be the start of a bracketed paste */
+					if(full && oneline && !refline->buf)
+					{
+						int matched = 1;
+						while(PASTE_BEGIN[matched] && (status = next_char(&c, 0, 0, 0, state)) && c == PASTE_BEGIN[matched])
+							matched++;
+						if(!PASTE_BEGIN[matched])
+						{
+							if(read_paste(state))
+								stop = get_pasted_line(str, state);
+							break;
+						}
+						/* Not a paste after all, so what was read of it is typed as it is, and the character that didn't fit is taken next */
+						for(int i = 0; i < matched; i++)
+							add_char_to_string(str, PASTE_BEGIN[i], unlimited, 1, skip_mode, ctrl_l_buffer);
+						held = 1;
+						break;
+					}
+					/* Intentional fallthrough */
 				default:
 					if(refline->buf)
 					{
 						switch(c)
 						{
-							int found;
+							long found;
 							char findchar;
 							case 0x03:	/* Ctrl-C (next char) */
 								if(oldpos < refline->length-1)
 									add_char_to_string(str, refline->buf[oldpos], unlimited, 1, skip_mode, ctrl_l_buffer);
 								else
-									putchar_unlocked(7);	/* Ring bell */
+									echo_char(7);	/* Ring bell */
 								oldpos++;
 								break;
+							case 0x15:	/* Ctrl-U (copy to tab) */
+								found = line_column(str);
+								found = found < TAB_COLUMNS?state->tabs[found]:0;
+								if(!found || oldpos >= refline->length-1)
+									echo_char(7);	/* Ring bell */
+								for(; found > 0 && oldpos < refline->length-1; found--, oldpos++)
+									add_char_to_string(str, refline->buf[oldpos], unlimited, 1, skip_mode, ctrl_l_buffer);
+								break;
 							case 0x08:	/* Ctrl-H (copy rest of line) */
 							case 0x19:  /* Ctrl-Y (copy rest of line and re-edit */
 							case 0x04:	/* Ctrl-D (copy rest of line and terminate) */
 							case 0x06:	/* Ctrl-F (copy rest of line, no typing, and terminate) */
-								while(oldpos<refline->length-1)
+								if(oldpos < refline->length-1)
 								{
-									add_char_to_string(str, refline->buf[oldpos], unlimited, (c != 0x06 && c != 0x19), skip_mode, ctrl_l_buffer);
-									oldpos++;
+									add_slice_to_string(str, refline->buf+oldpos, refline->length-1-oldpos, unlimited, (c != 0x06 && c != 0x19), skip_mode, ctrl_l_buffer);
+									oldpos = refline->length-1;
 								}
 								if (c == 0x19)
 								{
+									/* The finished line becomes the old line, moved rather than copied */
 									add_char_to_string(str, '\n', unlimited, 1, 0, ctrl_l_buffer);
 									str->buf[str->length] = '\0';
-									copy_string(refline, str, 0);
+									delete_string(refline);
+									*refline = *str;
 									empty_string(str);
 									oldpos = 0;
 								}
@@ -830,7 +3978,7 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 									found++;
 								}
 								if(found >= refline->length-1)
-									putchar_unlocked(7);
+									echo_char(7);
 								else
 								{
 									if(c == 0x0F || c == 0x10)
@@ -853,7 +4001,7 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 								}
 								else
 								{
-									putchar_unlocked(7);
+									echo_char(7);
 								}
 								break;
 							case 0x05:	/* Ctrl-E (toggle insert mode) */
@@ -865,25 +4013,25 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 								{
 									str->length--;
 								}
-								printf("%s", up_arrow);
+								echo_text(up_arrow);
 								if(!(str->length))
 								{
-									printf("\r\n");
+									echo_text("\r\n");
 								}
 								if(oldpos > 0)
 									oldpos--;
 								break;
 							case 0x14:      /* Ctrl-T (type rest of old line, then new line, old aligned with new */
 							case 0x12:	/* Ctrl-R (type rest of old line, then new line, old aligned with old) */
-								putchar_unlocked((int)'\n');
+								echo_char('\n');
 								if (c == 0x14) {
-									putchar_unlocked((int)'\r');
-									for (int i = 0; i < str->length; i++) {putchar_unlocked((int)' ');}
+									echo_char('\r');
+									for (long i = 0; i < str->length; i++) {echo_char(' ');}
 								}
 								print_buffer(refline->buf+oldpos);
 								//print_char('\n');
 								//print_buffer(*str);
-								for (int i = 0; i < str->length; i++) {putchar_unlocked((str->buf)[i]);}
+								for (long i = 0; i < str->length; i++) {echo_char((str->buf)[i]);}
 								break;
 								break;
 							default:
@@ -892,7 +4040,7 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 									oldpos++;
 						}
 					}
-					else if(c == delim)
+					else if(c == delim && !(delim == ']' && state->patterns && pattern_open(str)))
 					{
 						if(c > 26)
 							print_char(c);
@@ -902,7 +4050,7 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 					{
 						if(c == 0x04)
 						{
-							//printf("\r\n");
+							//fprintf(term_out, "\r\n");
 							stop = 1;
 							//break;
 						}
@@ -921,21 +4069,93 @@ int get_string(struct string *str, char delim, int full, int unlimited, int lite
 					}
 			}
 		}
-	} while(!stop);
+	}
 	//bg_string(str);
 	if(ctrl_l_buffer)
 		finish_l_buffer(&ctrl_l_buffer, state);
 	add_char_to_string(str, '\0', 1, 0, 0, NULL);
 	str->length--;
-	free_string(refline);
+	delete_string(refline);
 	return 0;
 }
-struct string *get_lines(int *length, int literal, struct state_spec *state)
+int read_paste(struct state_spec *state)
+/* Called after the start of a bracketed paste. Reads everything up to the end-of-paste sequence into state->paste as-is, without looking at control characters or echoing it, then prints how many lines were pasted. Returns 0 if nothing was pasted */
+{
+	int end_length = strlen(PASTE_END);
+	long num_lines = 0;
+	int c;
+	struct string *paste = &state->paste;
+	delete_string(paste);
+	string_with_capacity(paste, 4096);
+	state->paste_pos = 0;
+	while((c = read_byte()) != EOF)
+	{
+		if(paste->length >= paste->space)
+			reserve_space(paste, paste->space*2);
+		paste->buf[paste->length++] = c;
+		if(c == '~' && paste->length >= end_length && !memcmp(paste->buf+paste->length-end_length, PASTE_END, end_length))
+		{
+			paste->length -= end_length;
+			break;
+		}
+	}
+	paste->buf[paste->length] = '\0';
+	if(!paste->length)
+	{
+		delete_string(paste);
+		return 0;
+	}
+	/* Count the lines just as get_pasted_line splits them up: at each \r or \n, with \r\n ending only one */
+	for(long i = 0; i < paste->length; i++)
+	{
+		if(paste->buf[i] == '\r' || (paste->buf[i] == '\n' && (!i || paste->buf[i-1] != '\r')))
+			num_lines++;
+	}
+	if(paste->buf[paste->length-1] != '\r' && paste->buf[paste->length-1] != '\n')
+		num_lines++;
+	if(!quiet)
+		fprintf(term_out, "\r\n%li LINES PASTED.\r\n", num_lines);
+	return 1;
+}
+int get_pasted_line(struct string *str, struct state_spec *state)
+/* Moves the next line of pending pasted text onto the end of str, ending it with \r the way a typed line is ended. Pasted text is inserted literally, with either \r, \n or \r\n ending a line. Returns 1 if a whole line was added; otherwise the last, unfinished line of the paste has been added and echoed, and the user can carry on typing it */
+{
+	struct string *paste = &state->paste;
+	char *start = paste->buf + state->paste_pos;
+	long left = paste->length - state->paste_pos;
+	long length;
+	char *end = memchr(start, '\r', left);
+	char *lf = memchr(start, '\n', end?end-start:left);
+	if(lf)
+		end = lf;
+	length = end?end-start:left;
+	reserve_space(str, str->length + length + 1);
+	memcpy(str->buf + str->length, start, length);
+	str->length += length;
+	if(end)
+	{
+		str->buf[str->length++] = '\r';
+		state->paste_pos += length+1;
+		if(*end == '\r' && state->paste_pos < paste->length && paste->buf[state->paste_pos] == '\n')
+			state->paste_pos++;
+	}
+	else
+	{
+		str->buf[str->length] = '\0';
+		print_buffer(str->buf);
+		state->paste_pos = paste->length;
+	}
+	if(state->paste_pos >= paste->length)
+		delete_string(paste);
+	return end != NULL;
+}
+struct string *get_lines(long *length, int literal, struct state_spec *state)
 /* Gets multiple lines of text for APPEND/INSERT/CHANGE/EDIT/MODIFY/READ FROM by calling get_string() repeatedly */
 {
 	struct string *input_lines = NULL;
 	struct string buffer;
 	int done = 0;
+	long paged = 0;  /* Number of lines at the start of input_lines that have been paged out */
 	*length = 0;
 	do {
 		get_string(&buffer, '\0', 1, 1, literal, 1, NULL, state);
@@ -944,17 +4164,547 @@ struct string *get_lines(int *length, int literal, struct state_spec *state)
 		if(buffer.buf[0] != 0x04)
 		{
 			buffer.buf[buffer.length-1] = '\n';
+			if(literal && state->tabs_set && memchr(buffer.buf, '\t', buffer.length))
+			{
+				struct string expanded;
+				string_with_capacity(&expanded, expand_tabs(NULL, buffer.buf, buffer.length, state->tabs));
+				expanded.length = expand_tabs(expanded.buf, buffer.buf, buffer.length, state->tabs);
+				expanded.buf[expanded.length] = '\0';
+				delete_string(&buffer);
+				buffer = expanded;
+			}
 			if(done)
-				printf("\r\n");
+				fprintf(term_out, "\r\n");
 			(*length)++;
-			input_lines = realloc(input_lines, (*length)*sizeof(struct string));
-			input_lines[*length-1] = buffer;
+			input_lines = mem_realloc(input_lines, (*length)*sizeof(struct string), MEM_LINES);
+			input_lines[*length-1] = *intern_string(&buffer);
+			/* When reading a file in paged mode, page the lines out as they come in, a page at a time */
+			if(literal && pager.limit && pager.resident > pager.limit && *length - paged >= PAGE_LINES)
+			{
+				page_out_lines(input_lines, paged, *length-1);
+				paged = *length;
+			}
 		}
 	} while(!done);
 	return input_lines;
 }
+int set_tabs(char *stops, struct state_spec *state)
+/* Sets the tab stops to the columns listed in stops, separated by commas, as the TABS command does. There can be up to MAX_TABS of them, in increasing order.
+   Builds the state's tab table from them, which gives for every column the number of spaces to the next stop. Returns 0, leaving the stops alone, if the list is bad */
+{
+	long columns[MAX_TABS];
+	int num_tabs = 0;
+	char *p = stops;
+	while(*p)
+	{
+		char *end;
+		long column = strtol(p, &end, 10);
+		if(end == p || num_tabs == MAX_TABS || column < 1 || column >= TAB_COLUMNS || (num_tabs && column <= columns[num_tabs-1]))
+			return 0;
+		columns[num_tabs++] = column;
+		for(p = end; *p == ' '; p++);
+		if(*p == ',')
+			p++;
+		else if(*p)
+			return 0;
+	}
+	if(!num_tabs)
+		return 0;
+	for(int column = 0, next = 0; column < TAB_COLUMNS; column++)
+	{
+		while(next < num_tabs && columns[next] <= column)
+			next++;
+		state->tabs[column] = next < num_tabs?columns[next] - column:0;
+	}
+	return 1;
+}
+void print_tabs(struct state_spec *state)
+/* Prints the tab stops, as TABS does when no stops are given */
+{
+	int first = 1;
+	for(int column = 1; column < TAB_COLUMNS; column++)
+	{
+		if(state->tabs[column-1] == 1)
+		{
+			fprintf(term_out, first?"%i":",%i", column);
+			first = 0;
+		}
+	}
+	fprintf(term_out, "\r\n");
+}
+long expand_tabs(char *dst, char *src, long length, unsigned char *tabs)
+/* Copies the length characters of the line src to dst, expanding each tab to spaces up to the next stop in the tab table tabs; a tab past the last stop is kept as it is.
+   Returns the length of the result. If dst is NULL nothing is copied, and the length is just worked out. The tabs are found with memchr, so the text between them goes by as fast as memcpy */
+{
+	char *end = src + length;
+	long column = 0;
+	while(src < end)
+	{
+		char *tab = memchr(src, '\t', end - src);
+		long run = (tab?tab:end) - src;
+		if(dst)
+			memcpy(dst + column, src, run);
+		column += run;
+		if(!tab)
+			break;
+		int width = column < TAB_COLUMNS?tabs[column]:0;
+		if(dst)
+		{
+			if(width)
+				memset(dst + column, ' ', width);
+			else
+				dst[column] = '\t';
+		}
+		column += width?width:1;
+		src = tab + 1;
+	}
+	return column;
+}
+long line_column(struct string *str)
+/* Returns the column the next character typed into str will be in, counting from 0 at the start of the line being typed. There are no tab stops
+   from TAB_COLUMNS on, so it gives up looking for the start of the line there and returns TAB_COLUMNS, rather than going back over all of a long line */
+{
+	for(long i = str->length; i > 0 && str->length - i < TAB_COLUMNS; i--)
+	{
+		if(str->buf[i-1] == '\r' || str->buf[i-1] == '\n')
+			return str->length - i;
+	}
+	return str->length < TAB_COLUMNS?str->length:TAB_COLUMNS;
+}
+void start_loading(FILE *file, long line, struct state_spec *state)
+/* Starts a thread loading the lines of file into the main buffer in front of the given line, for READ FROM of a big file */
+{
+	struct loader *loader = mem_alloc(sizeof(struct loader), MEM_OTHER);
+	pthread_mutex_init(&loader->lock, NULL);
+	loader->file = file;
+	loader->lines = NULL;
+	loader->num_lines = 0;
+	loader->space = 0;
+	loader->num_bytes = 0;
+	loader->done = 0;
+	loader->insert_at = line;
+	loader->dot = state->dot = line-1;
+	loader->expand = state->tabs_set;
+	memcpy(loader->tabs, state->tabs, TAB_COLUMNS);
+	/* A file read into an empty buffer becomes its source, unless its tabs are being expanded */
+	loader->track = !state->dollar && !loader->expand;
+	loader->offset = 0;
+	loader->hash = 0;
+	if(loader->track)
+		start_source(state, fileno(file));
+	state->loader = loader;
+	pthread_create(&loader->thread, NULL, load_lines, loader);
+}
+void *load_lines(void *arg)
+/* Body of the loading thread. Reads the file LOAD_CHUNK bytes at a time and splits each chunk into lines, handing them over a chunk at a time */
+{
+	struct loader *loader = arg;
+	char *chunk = mem_alloc(LOAD_CHUNK, MEM_OTHER);
+	struct string partial = {0, 0, {NULL}};
+	int eof = 0;
+	while(!eof)
+	{
+		long length = fread(chunk, 1, LOAD_CHUNK, loader->file);
+		char *nul = memchr(chunk, '\0', length);
+		struct string *lines = NULL;
+		long num_lines = 0, space = 0;
+		if(nul)
+			length = nul - chunk;
+		eof = nul || length < LOAD_CHUNK;
+		long num_bytes = split_chunk(chunk, length, eof, &partial, &lines, &num_lines, &space, loader->expand, loader->tabs);
+		for(long i = 0; keep_indexes && loader->track && i < num_lines; i++)
+			loader->hash = hash_line(loader->hash, &lines[i]);
+		pthread_mutex_lock(&loader->lock);
+		if(loader->num_lines + num_lines > loader->space)
+		{
+			loader->space = loader->num_lines + num_lines;
+			loader->lines = mem_realloc(loader->lines, loader->space * sizeof(struct string), MEM_LINES);
+		}
+		if(num_lines)
+			memcpy(loader->lines + loader->num_lines, lines, num_lines * sizeof(struct string));
+		loader->num_lines += num_lines;
+		loader->num_bytes += num_bytes;
+		loader->done = eof;
+		pthread_mutex_unlock(&loader->lock);
+		mem_free(lines, MEM_LINES);
+	}
+	mem_free(chunk, MEM_OTHER);
+	mem_free(partial.buf, MEM_STRINGS);
+	return NULL;
+}
+long split_chunk(char *chunk, long length, int eof, struct string *partial, struct string **lines, long *num_lines, long *space, int expand, unsigned char *tabs)
+/* Splits a chunk of a file being read into lines with memchr, adding them to the end of *lines, which has room for *space of them. These are the same lines get_lines would have read a character at a time:
+   each ends in \n, and one is added to a last line without it. The caller ends the file at any \0, as get_lines does. A line that carries on past the end of the chunk is kept in partial until the next one, unless eof says there won't be one.
+   If expand is true, tabs are expanded with the given tab table. The lines are built as SHARED text but not interned, since the intern table belongs to the main thread. Returns the number of characters in the lines */
+{
+	long num_bytes = 0;
+	for(char *start = chunk; start < chunk + length || (eof && partial->length); )
+	{
+		long left = chunk + length - start;
+		char *end = left > 0?memchr(start, '\n', left):NULL;
+		if(!end && !eof)
+		{
+			/* Line carries on into the next chunk */
+			cat_slice(partial, &(struct string){length, length, {chunk}}, start - chunk, -1);
+			break;
+		}
+		long line_length = end?end - start + 1:chunk + length - start;
+		if(*num_lines >= *space)
+		{
+			*space = *space?*space*2:1024;
+			*lines = mem_realloc(*lines, *space * sizeof(struct string), MEM_LINES);
+		}
+		struct string *line = &(*lines)[*num_lines];
+		char *text = start;
+		long text_length = line_length;
+		if(partial->length)
+		{
+			cat_slice(partial, &(struct string){length, length, {chunk}}, start - chunk, line_length);
+			text = partial->buf;
+			text_length = partial->length;
+		}
+		/* Most lines have no tabs, and memchr finds that out many bytes at a time */
+		int has_tabs = expand && memchr(text, '\t', text_length);
+		long expanded_length = has_tabs?expand_tabs(NULL, text, text_length, tabs):text_length;
+		struct line_text *t = mem_alloc(sizeof(struct line_text) + expanded_length + 2, MEM_TEXT);
+		t->refs = 1;
+		t->hash = 0;
+		t->next = NULL;
+		t->swap_offset = -1;
+		if(has_tabs)
+			expand_tabs(t->text, text, text_length, tabs);
+		else
+			memcpy(t->text, text, text_length);
+		line->length = expanded_length;
+		if(!end)
+			t->text[line->length++] = '\n';
+		t->text[line->length] = '\0';
+		line->space = SHARED;
+		line->buf = t->text;
+		num_bytes += line->length;
+		(*num_lines)++;
+		partial->length = 0;
+		start += line_length;
+	}
+	return num_bytes;
+}
+void adopt_lines(struct string *lines, long num_lines)
+/* Readies lines made by split_chunk for the main buffer, on the main thread: they are counted as resident, and interned if interning is on */
+{
+	for(long i = 0; i < num_lines; i++)
+	{
+		pager.resident += lines[i].length;
+		if(intern_lines)
+		{
+			struct string interned = {0, 0, {NULL}};
+			intern_slice(&interned, lines[i].buf, lines[i].length);
+			release_text(lines[i].buf);
+			lines[i] = interned;
+		}
+	}
+}
+struct string *stream_lines(FILE *file, long *num_lines, struct state_spec *state)
+/* Reads the lines of file for READ FROM when it is a pipe or the like, returning them and their number in num_lines just as get_lines would. A thread does the reading (see read_stream) while the lines are split out here.
+   In paged mode the lines are paged out a page at a time as they come in */
+{
+	struct stream stream;
+	struct string *lines = NULL;
+	struct string partial = {0, 0, {NULL}};
+	long space = 0, paged = 0;
+	int eof = 0;
+	char last = '\n';  /* The last character of the text */
+	pthread_mutex_init(&stream.lock, NULL);
+	pthread_cond_init(&stream.changed, NULL);
+	stream.fd = fileno(file);
+	stream.stop = 0;
+	for(int i = 0; i < 2; i++)
+	{
+		stream.buffers[i] = mem_alloc(LOAD_CHUNK, MEM_OTHER);
+		stream.lengths[i] = -1;
+	}
+	*num_lines = 0;
+	pthread_create(&stream.thread, NULL, read_stream, &stream);
+	for(int i = 0; !eof; i ^= 1)
+	{
+		pthread_mutex_lock(&stream.lock);
+		while(stream.lengths[i] < 0)
+			pthread_cond_wait(&stream.changed, &stream.lock);
+		long length = stream.lengths[i];
+		pthread_mutex_unlock(&stream.lock);
+		char *nul = memchr(stream.buffers[i], '\0', length);
+		eof = nul || length < LOAD_CHUNK;
+		if(nul)
+			length = nul - stream.buffers[i];
+		if(length)
+			last = stream.buffers[i][length-1];
+		long first = *num_lines;
+		split_chunk(stream.buffers[i], length, eof, &partial, &lines, num_lines, &space, state->tabs_set, state->tabs);
+		adopt_lines(lines + first, *num_lines - first);
+		pthread_mutex_lock(&stream.lock);
+		stream.lengths[i] = -1;
+		stream.stop = eof;
+		pthread_cond_signal(&stream.changed);
+		pthread_mutex_unlock(&stream.lock);
+		if(pager.limit && pager.resident > pager.limit && *num_lines - paged >= PAGE_LINES)
+		{
+			page_out_lines(lines, paged, *num_lines-1);
+			paged = *num_lines;
+		}
+	}
+	/* Like get_lines, end the line on the terminal after a last line that had no \n */
+	if(last != '\n')
+		fprintf(term_out, "\r\n");
+	pthread_join(stream.thread, NULL);
+	pthread_cond_destroy(&stream.changed);
+	pthread_mutex_destroy(&stream.lock);
+	for(int i = 0; i < 2; i++)
+		mem_free(stream.buffers[i], MEM_OTHER);
+	mem_free(partial.buf, MEM_STRINGS);
+	return lines;
+}
+void *read_stream(void *arg)
+/* Body of the thread reading a stream. Fills the two buffers in turn, each with as many reads as it takes to fill it or reach the end of the file, and waits while both are full */
+{
+	struct stream *stream = arg;
+	for(int i = 0; ; i ^= 1)
+	{
+		pthread_mutex_lock(&stream->lock);
+		while(stream->lengths[i] >= 0 && !stream->stop)
+			pthread_cond_wait(&stream->changed, &stream->lock);
+		int stop = stream->stop;
+		pthread_mutex_unlock(&stream->lock);
+		if(stop)
+			break;
+		long length = 0;
+		while(length < LOAD_CHUNK)
+		{
+			long n = read(stream->fd, stream->buffers[i] + length, LOAD_CHUNK - length);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n <= 0)
+				break;
+			length += n;
+		}
+		pthread_mutex_lock(&stream->lock);
+		stream->lengths[i] = length;
+		pthread_cond_signal(&stream->changed);
+		pthread_mutex_unlock(&stream->lock);
+		if(length < LOAD_CHUNK)
+			break;
+	}
+	return NULL;
+}
+void absorb_lines(struct state_spec *state, int wait)
+/* Moves the lines the loading thread has read so far into the main buffer, first waiting for it to read the whole file if wait is true. If that was the last of them, the load is finished off and its WORDS count left for report_loading to print */
+{
+	struct loader *loader = state->loader;
+	struct string *lines;
+	long num_lines;
+	int done;
+	if(wait)
+		pthread_join(loader->thread, NULL);
+	pthread_mutex_lock(&loader->lock);
+	lines = loader->lines;
+	num_lines = loader->num_lines;
+	done = loader->done;
+	loader->lines = NULL;
+	loader->num_lines = loader->space = 0;
+	pthread_mutex_unlock(&loader->lock);
+	adopt_lines(lines, num_lines);
+	if(num_lines)
+	{
+		replace_lines(state, lines, num_lines, loader->insert_at, 0);
+		if(loader->track)
+			loader->offset = source_lines(state, loader->insert_at, num_lines, loader->offset);
+		loader->insert_at += num_lines;
+		if(state->dot == loader->dot)
+			state->dot = loader->dot = loader->insert_at - 1;
+	}
+	mem_free(lines, MEM_LINES);
+	if(done)
+	{
+		if(!wait)
+			pthread_join(loader->thread, NULL);
+		pthread_mutex_destroy(&loader->lock);
+		if(loader->track)
+		{
+			check_source(state, fileno(loader->file), loader->num_bytes, loader->insert_at - 1);
+			finish_index(state, loader->hash);
+		}
+		fclose(loader->file);
+		state->loaded_words = loader->num_bytes / 3;
+		if (loader->num_bytes % 3)
+			state->loaded_words++;
+		mem_free(loader, MEM_OTHER);
+		state->loader = NULL;
+	}
+}
+void report_loading(struct state_spec *state)
+/* Called between commands. Takes in any lines loaded by a background READ FROM, and prints its WORDS count once it has finished */
+{
+	if(state->loader)
+		absorb_lines(state, 0);
+	if(state->loaded_words >= 0)
+	{
+		fprintf(term_out, "%li WORDS.\r\n", state->loaded_words);
+		state->loaded_words = -1;
+	}
+}
+void finish_loading(struct state_spec *state)
+/* Waits for the loading thread to read the rest of its file, then moves all of it into the main buffer. Used before anything that needs $, a search, lines past those loaded so far, or changes the number of lines */
+{
+	if(state->loader)
+		absorb_lines(state, 1);
+}
+int filter_lines(char *shell_command, long first, long last, struct string **lines, long *num_lines, struct state_spec *state)
+/* Runs shell_command with lines first through last of the main buffer as its input, for FILTER THROUGH, and puts the lines of its output in lines and their number in num_lines.
+   The lines are written to the command and its output read back as they come, watching both pipes with poll, so that neither side is left waiting on a full pipe.
+   Returns 0, with no lines, if the command couldn't be run or didn't exit successfully */
+{
+	int to_child[2], from_child[2];
+	*lines = NULL;
+	*num_lines = 0;
+	if(pipe(to_child))
+		return 0;
+	if(pipe(from_child))
+	{
+		close(to_child[0]);
+		close(to_child[1]);
+		return 0;
+	}
+	fflush(term_out);
+	pid_t pid = fork();
+	if(!pid)
+	{
+		dup2(to_child[0], 0);
+		dup2(from_child[1], 1);
+		close(to_child[0]);
+		close(to_child[1]);
+		close(from_child[0]);
+		close(from_child[1]);
+		signal(SIGPIPE, SIG_DFL);
+		execl("/bin/sh", "sh", "-c", shell_command, (char *)NULL);
+		_exit(127);
+	}
+	close(to_child[0]);
+	close(from_child[1]);
+	if(pid < 0)
+	{
+		close(to_child[1]);
+		close(from_child[0]);
+		return 0;
+	}
+	/* A command that stops reading early, such as head, would otherwise kill qed with SIGPIPE */
+	void (*old_handler)(int) = signal(SIGPIPE, SIG_IGN);
+	fcntl(to_child[1], F_SETFL, O_NONBLOCK);
+	char *out = mem_alloc(LOAD_CHUNK, MEM_OTHER);  /* Lines on their way to the command. They're copied here since getting later lines can page earlier ones out */
+	char *in = mem_alloc(LOAD_CHUNK, MEM_OTHER);
+	long out_length = 0, out_pos = 0;
+	long line = first, line_pos = 0;  /* The next line to be copied to out, and how much of it already has been */
+	long space = 0, paged = 0;
+	struct string partial = {0, 0, {NULL}};
+	int writing = 1, ended = 0;
+	while(1)
+	{
+		if(writing && out_pos == out_length)
+		{
+			out_pos = out_length = 0;
+			while(line <= last && out_length < LOAD_CHUNK)
+			{
+				struct string *s = get_line(line, state);
+				long n = s->length - line_pos < LOAD_CHUNK - out_length?s->length - line_pos:LOAD_CHUNK - out_length;
+				memcpy(out + out_length, s->buf + line_pos, n);
+				out_length += n;
+				line_pos += n;
+				if(line_pos == s->length)
+				{
+					line++;
+					line_pos = 0;
+				}
+			}
+			if(!out_length)
+			{
+				close(to_child[1]);
+				writing = 0;
+			}
+		}
+		struct pollfd fds[2] = {{from_child[0], POLLIN, 0}, {writing?to_child[1]:-1, POLLOUT, 0}};
+		if(poll(fds, 2, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(fds[1].revents)
+		{
+			long n = write(to_child[1], out + out_pos, out_length - out_pos);
+			if(n > 0)
+				out_pos += n;
+			else if(errno != EAGAIN && errno != EINTR)
+			{
+				/* The command has stopped reading */
+				close(to_child[1]);
+				writing = 0;
+			}
+		}
+		if(fds[0].revents)
+		{
+			long length = read(from_child[0], in, LOAD_CHUNK);
+			if(length < 0 && errno == EINTR)
+				continue;
+			if(length < 0)
+				length = 0;
+			/* As with READ FROM, a \0 ends the text, though the rest of the output still has to be read so the command can finish */
+			if(!ended)
+			{
+				char *nul = memchr(in, '\0', length);
+				if(nul)
+					length = nul - in;
+				ended = nul || !length;
+				long before = *num_lines;
+				split_chunk(in, length, ended, &partial, lines, num_lines, &space, state->tabs_set, state->tabs);
+				adopt_lines(*lines + before, *num_lines - before);
+				if(pager.limit && pager.resident > pager.limit && *num_lines - paged >= PAGE_LINES)
+				{
+					page_out_lines(*lines, paged, *num_lines-1);
+					paged = *num_lines;
+				}
+			}
+			if(!length)
+				break;
+		}
+	}
+	if(writing)
+		close(to_child[1]);
+	close(from_child[0]);
+	int status = 0;
+	while(waitpid(pid, &status, 0) < 0 && errno == EINTR);
+	signal(SIGPIPE, old_handler);
+	mem_free(out, MEM_OTHER);
+	mem_free(in, MEM_OTHER);
+	mem_free(partial.buf, MEM_STRINGS);
+	if(!ended || !WIFEXITED(status) || WEXITSTATUS(status))
+	{
+		for(long i = 0; i < *num_lines; i++)
+			free_buf(&(*lines)[i]);
+		mem_free(*lines, MEM_LINES);
+		*lines = NULL;
+		*num_lines = 0;
+		return 0;
+	}
+	return 1;
+}
 struct command_spec* get_command(struct state_spec *state)
-/* Reads a command from stdin/a buffer and decodes it into a command_spec struct. Returns NULL if there is an error while reading the command */
+/* Reads a command from stdin/a buffer and decodes it into a command_spec struct. Returns NULL if there is an error while reading the command.
+   The command and everything in it comes from the parser arena, so it lasts until free_command_spec, which must be called before the next command is read */
+{
+	scratch = &parser_arena;
+	struct command_spec *command = parse_command(state);
+	scratch = NULL;
+	return command;
+}
+struct command_spec* parse_command(struct state_spec *state)
+/* Does the work of get_command */
 {
 	char c = '\0';
 	int done = 0;
@@ -966,21 +4716,20 @@ struct command_spec* get_command(struct state_spec *state)
 	int rubout_pressed = 0;
 	struct command_spec *command;
 	struct line_spec **line;
-	command = malloc(sizeof(struct command_spec));
-	command->start = NULL;
-	command->end = NULL;
-	bzero(&command->arg1, sizeof(struct string));
-	bzero(&command->arg2, sizeof(struct string));
-	command->flag = 'G';
-	command->num = -1;
+	command = new_command_spec();
 	line = &(command->start);
-	printf("*");
+	echo_text("*");
 	do
 	{
 		int s;
 		if(!(s = next_char(&c, 0, 0, 0, state)))
-		/* Input stream has closed! Complain and exit. */
+		/* Input stream has closed! Complain and exit, or when scripted just drop the unfinished command; the caller complains */
 		{
+			if(scripted)
+			{
+				free_command_spec(command);
+				return NULL;
+			}
 			err(state);
 			exit(1);
 		}
@@ -993,7 +4742,7 @@ struct command_spec* get_command(struct state_spec *state)
 			}
 			else
 			{
-				printf("%c", 0x07);
+				echo_char(0x07);
 				rubout_pressed = 1;
 			}
 		}
@@ -1037,7 +4786,7 @@ struct command_spec* get_command(struct state_spec *state)
 			*line = new_line_spec(c==' '?'+':c,'c',0,NULL);
 			cmd_valid = 0;
 			compound_valid = 0;
-			putchar_unlocked((int)c);
+			echo_char(c);
 		}
 		else if(c == '.' || c == '$')
 		{
@@ -1062,11 +4811,11 @@ struct command_spec* get_command(struct state_spec *state)
 				return NULL;
 			}
 			rel_valid = 0;
-			putchar_unlocked((int)c);
+			echo_char(c);
 		}
-		else if(c == ':' || c == '[')
+		else if(c == ':' || c == '[' || c == '?')
 		{
-			putchar_unlocked((int)c);
+			echo_char(c);
 			if(*line == NULL)
 			{
 				*line = new_line_spec('+',c,0,NULL);
@@ -1097,7 +4846,7 @@ struct command_spec* get_command(struct state_spec *state)
 			compound_valid = 0;
 			second_addr = 1;
 			rel_valid = 1;
-			putchar_unlocked((int)c);
+			echo_char(c);
 		}
 		else if((cmd_char_ptr = strchr(cmd_chars, c)))
 		/* Received a command character */
@@ -1117,12 +4866,12 @@ struct command_spec* get_command(struct state_spec *state)
 				return NULL;
 			}
 			cmd_str = cmd_strings[cmd_char_index];
-	 		printf("%s", cmd_str);
+	 		echo_text(cmd_str);
 			done = 1;
 			command->command = c;
 			if(!strchr(cmd_noconf, c))
 			{
-				if(c == 'B' || c == 'G' || c == 'J' || c == 'K' || c == 'L')
+				if(c == 'B' || c == 'G' || c == 'J' || c == 'K' || c == 'L' || c == 'U')
 				{
 					get_buffer_name(command, state);
 					if(!command->arg1.buf)
@@ -1131,52 +4880,72 @@ struct command_spec* get_command(struct state_spec *state)
 						return NULL;
 					}
 				}
-				if(c == 'R' || c == 'W')
+				if(c == 'R' || c == 'W' || c == '!')
 				{
 					do
 					{
 						next_char(&c, 0, 1, 0, state);
 					} while(c == ' ' || c == '\t' || c == '\n');
 					get_string(&(command->arg1), c, 0, 1, 0, 1, NULL, state);
-				}
-				else if(c == 'S')
-				{
-					c = get_flags(command, state);
-					if(!c)
-					{
-						free_command_spec(command);
-						return NULL;
-					}
-					get_string(&(command->arg1), c, 0, 1, 0, 1, NULL, state);
-					if (!state->quick)
-					{
-						printf(" FOR ");
-						print_char(c);
-					}
-					get_string(&(command->arg2), c, 0, 1, 0, 1, NULL, state);
-					if(command->arg2.length == 0)
+				}
+				else if(c == 'T')
+				{
+					/* The . after the stops confirms the command */
+					get_string(&(command->arg1), '.', 0, 1, 0, 1, NULL, state);
+				}
+				else if(c == 'S' || c == 'X')
+				{
+					if(!(c == 'S'?get_substitution(command, state):get_every(command, state)))
 					{
 						free_command_spec(command);
 						return NULL;
 					}
 				}
-				next_char(&c, 1, 0, 0, state);
-				if(c != '.')
+				else if(c == 'O' && !get_order(command, state))
 				{
 					free_command_spec(command);
 					return NULL;
 				}
-				print_char(c);
+				else if(c == 'N' && !get_notation(command, state))
+				{
+					free_command_spec(command);
+					return NULL;
+				}
+				/* TABS and ORDER have already read their confirming . */
+				if(command->command != 'T' && command->command != 'O')
+				{
+					next_char(&c, 1, 0, 0, state);
+					if(c != '.')
+					{
+						free_command_spec(command);
+						return NULL;
+					}
+					print_char(c);
+				}
 			}
 		}
-		else {printf("%c", 0x07);}
+		else {echo_char(0x07);}
 	} while(!done);
 	return command;
 }
-int resolve_line_spec(struct line_spec *line, struct state_spec *state)
+struct command_spec *new_command_spec()
+/* Constructor for a command spec with no addresses or arguments yet, in the parser arena */
+{
+	struct command_spec *command = arena_alloc(&parser_arena, sizeof(struct command_spec));
+	command->start = NULL;
+	command->end = NULL;
+	bzero(&command->arg1, sizeof(struct string));
+	bzero(&command->arg2, sizeof(struct string));
+	command->flag = 'G';
+	command->num = -1;
+	command->sub = NULL;
+	return command;
+}
+long resolve_line_spec(struct line_spec *line, struct state_spec *state)
 /* Given a line_spec struct, which may involve searches, relative offsets, etc., resolves it to an actual line number */
 {
-	int line_number = 0, first = 1;
+	long line_number = 0;
+	int first = 1;
 	if(!state || !(state->main_buffer))
 	{
 		return -1;
@@ -1194,12 +4963,19 @@ int resolve_line_spec(struct line_spec *line, struct state_spec *state)
 			line_number += state->dot;
 			break;
 			case '$':
+			finish_loading(state);
 			line_number += state->dollar;
 			break;
 			case ':':
 			case '[':
+			finish_loading(state);
+			set_buffer(0, &line->search, state);
+			if(!(line_number = find_string(&line->search, first?state->dot+1:line_number, line->type == ':', 0, state))) {return -1;}
+			break;
+			case '?':
+			finish_loading(state);
 			set_buffer(0, &line->search, state);
-			if(!(line_number = find_string(&line->search, first?state->dot+1:line_number, line->type == ':', state))) {return -1;}
+			if(!(line_number = find_string(&line->search, first?state->dot-1:line_number-1, 0, 1, state))) {return -1;}
 			break;
 			default:
 			return -1;
@@ -1207,6 +4983,8 @@ int resolve_line_spec(struct line_spec *line, struct state_spec *state)
 		line = line->next;
 		first = 0;
 	}
+	if(line_number > state->dollar)
+		finish_loading(state);
 	if(line_number < 0)
 		return 1;
 	else if(line_number > state->dollar)
@@ -1217,8 +4995,16 @@ int resolve_line_spec(struct line_spec *line, struct state_spec *state)
 int execute_command(struct command_spec *command, struct state_spec *state)
 /* Takes a command_spec struct, generated by get_command(), and executes it on the current state */
 {
-	int line1 = state->dot, line2 = state->dot;
+	long line1 = state->dot, line2 = state->dot;
 	char *sep = "\r";  /* Line separator used when printing lines; the P command will alter it depending on the user's response to DOUBLE? */
+	int finished = 0;  /* Set by EVERY when a buffer it called FINISHED */
+	/* Take in whatever a background READ FROM has loaded so far. Commands that change the number of lines, or need the whole buffer, wait for the rest */
+	if(state->loader)
+	{
+		absorb_lines(state, 0);
+		if(strchr("!ACDFGIORUWX", command->command))
+			finish_loading(state);
+	}
 	/* Take the line spec for the start address, e.g. 3+4[foo], and resolve it to the actual line it refers to */
 	if(command->start)
 	{
@@ -1230,7 +5016,7 @@ int execute_command(struct command_spec *command, struct state_spec *state)
 		}
 	}
 	/* For most commands, line 0 should be taken to mean line 1 (there is no actual line 0) */
-	if(line1 == 0 && command->command != 'A' && command->command != '=' && command->command != 'R')
+	if(line1 == 0 && command->command != 'A' && command->command != '=' && command->command != 'R' && command->command != 'U')
 		line1 = 1;
 	if(command->end)
 	{
@@ -1243,21 +5029,25 @@ int execute_command(struct command_spec *command, struct state_spec *state)
 	}
 	else
 		line2 = line1;
-	if(line2 == 0 && command->command != 'A' && command->command != '=' && command->command != 'R')
+	if(line2 == 0 && command->command != 'A' && command->command != '=' && command->command != 'R' && command->command != 'U')
 		line2 = 1;
  	if(command->command == '\n' && !command->start) 
 		line2 = ++line1;
+	if(line2 > state->dollar)
+		finish_loading(state);
 	/* Error out if end line is before start line, or if end line is past the end of the file */
 	if(!strchr(cmd_noaddr, command->command) && (line2 < line1 || line2 > state->dollar))
 	{
 		err(state);
 		return 0;
 	}
-	if(command->command != '=' && command->command != '<' && command->command != '\n')
-		printf("\r\n");
+	/* End the line the command was echoed on; clients of a server don't get the echo */
+	if(command->command != '=' && command->command != '<' && command->command != '\n' && !scripted)
+		fprintf(term_out, "\r\n");
 	switch(command->command)
 	{
-		int i, n, num_lines, done;
+		long i, n, num_lines;
+		int done;
 		char c;
 		struct string buffer;
 		struct string *input_lines;
@@ -1268,38 +5058,38 @@ int execute_command(struct command_spec *command, struct state_spec *state)
 			return 0;
 		}
 		state->dot = state->dot - 1;
-		print_string(&state->main_buffer[state->dot]);
+		print_string(get_line(state->dot, state));
 		break;
 	case '=':
-		printf("%i\r\n", line1);
+		fprintf(term_out, "%li\r\n", line1);
 		break;
 	case 'P':
-		printf("\r\nDOUBLE? ");
+		fprintf(term_out, "\r\nDOUBLE? ");
 		next_char(&c, 1, 1, 0, state);
 		if(c == 'Y')
 		{
 			sep = "\r\n";
-			printf("ES");
+			fprintf(term_out, "ES");
 		}
 		else if(c == 'N')
 		{
 			sep = "";
-			printf("O");
+			fprintf(term_out, "O");
 		}
 		else
 		{
-			printf("\r\n");
+			fprintf(term_out, "\r\n");
 			err(state);
 			return 0;
 		}
-		printf("\r\n");
+		fprintf(term_out, "\r\n");
 	/* Intentional fallthrough */
 	case '/':
 	case '\n':
 		for(i=line1; i<=line2; i++)
 		{
-			print_string(&state->main_buffer[i]);
-			printf("%s", sep);
+			print_string(get_line(i, state));
+			fprintf(term_out, "%s", sep);
 		}
 		state->dot = line2;
 		break;
@@ -1312,6 +5102,8 @@ int execute_command(struct command_spec *command, struct state_spec *state)
 		done = 0;
 		if(!command->start && command->command != 'I')
 			line1 = state->dollar;
+		line2 = state->dot;  /* Kept to put dot back if the lines are thrown away */
+		n = line1 + 1;
 		do {
 			get_string(&buffer, '\0', 1, 1, 0, 1, NULL, state);
 			//dbg_string(&buffer);
@@ -1321,125 +5113,234 @@ int execute_command(struct command_spec *command, struct state_spec *state)
 			{
 				state->dot = ++line1;
 				buffer.buf[buffer.length-1] = '\n';
-				state->main_buffer = realloc(state->main_buffer, sizeof(struct string) * (state->dollar+2));
+				state->main_buffer = mem_realloc(state->main_buffer, sizeof(struct string) * (state->dollar+2), MEM_LINES);
 				for(i = state->dollar; i>=line1; i--)
 				{
 					state->main_buffer[i+1] = state->main_buffer[i];
 				}
-				state->main_buffer[line1] = buffer;
+				state->main_buffer[line1] = *intern_string(&buffer);
 				state->dollar++;
+				lines_changed(state, line1, 0, 1);
 				if(done)
-					printf("\r\n");
+					fprintf(term_out, "\r\n");
 			}
 			else
 				delete_string(&buffer);
 		} while(!done);
+		if(input_cut_off(state))
+		{
+			replace_lines(state, NULL, 0, n, line1 - n + 1);
+			state->dot = line2;
+			err(state);
+			return 0;
+		}
 		break;
 	case 'C':
 		input_lines = get_lines(&num_lines, 0, state);
-		state->dollar++;
-		state->main_buffer = replace_elements_in_string_vector(state->main_buffer, &state->dollar, input_lines, num_lines, line1, line2-line1+1);
-		free(input_lines);
-		state->dollar--;
+		if(input_cut_off(state))
+		{
+			for(i = 0; i < num_lines; i++)
+				free_buf(&input_lines[i]);
+			mem_free(input_lines, MEM_LINES);
+			err(state);
+			return 0;
+		}
+		replace_lines(state, input_lines, num_lines, line1, line2-line1+1);
+		mem_free(input_lines, MEM_LINES);
 		state->dot = line1 + num_lines - 1;
 		break;
 	case 'E':
 	case 'M':
-		for(int line=line1; line<=line2; line++)
+		for(long line=line1; line<=line2; line++)
 		{
 			if(command->command == 'E')
-				print_string(&state->main_buffer[line]);
-			get_string(&buffer, '\0', 1, 1, 0, 1, &state->main_buffer[line], state);
-			state->dollar++;
-			state->main_buffer = replace_elements_in_string_vector(state->main_buffer, &state->dollar, &buffer, 1, line, 1);
-			state->dollar--;
+				print_string(get_line(line, state));
+			get_string(&buffer, '\0', 1, 1, 0, 1, get_line(line, state), state);
+			intern_string(&buffer);
+			replace_lines(state, &buffer, 1, line, 1);
 			state->dot = line;
 		}
 		break;
 	case 'L':
 	case 'G':
-		int buffer_length = 1; //length for the newlines and 1 for the terminating \0
-		for (i=line1; i<=line2; i++)
-		{
-			buffer_length += state->main_buffer[i].length;
-		}
-		buffer.buf = malloc(buffer_length+1);
-		buffer.space = buffer_length;
-		buffer.length = 0;
-		buffer.buf[0] = '\0';
-		for(int i=line1; i<=line2; i++)
+		input_lines = mem_calloc(sizeof(struct string), line2-line1+1, MEM_LINES);
+		for(i=line1; i<=line2; i++)
 		{
-			cat_strings(&buffer, &state->main_buffer[i]);
-			buffer.buf[buffer.length-1] = '\r';
+			share_string(&input_lines[i-line1], get_line(i, state));
 		}
-		set_buffer(buffer_for_char(command->arg1.buf[0]), &buffer, state);
+		set_buffer_lines(buffer_for_char(command->arg1.buf[0]), input_lines, line2-line1+1, state);
 		if (command->command == 'L')
 			break;
 		/* Intentional fallthrough to 'D' if command was 'G' */
 	case 'D':
-		state->dollar++;
-		state->main_buffer = replace_elements_in_string_vector(state->main_buffer, &state->dollar, NULL, 0, line1, line2-line1+1);
-		state->dollar--;
+		replace_lines(state, NULL, 0, line1, line2-line1+1);
 		state->dot = line1-1;
 		break;
 	case 'R':
 		if(!(state->file = fopen(command->arg1.buf, "r")))
 		{
 			err(state);
-			printf("I-O ERROR.\r\n");
+			fprintf(term_out, "I-O ERROR.\r\n");
 			return 0;
 		}
 		if(!command->start)
 			line1 = state->dollar;
 		line1++;
-		input_lines = get_lines(&num_lines, 1, state);
-		int num_bytes = 0;
-		for (int i = 0; i < num_lines; i++)
+		struct stat file_stat;
+		if(fstat(fileno(state->file), &file_stat))
+			file_stat.st_mode = 0;
+		if(!pager.limit && S_ISREG(file_stat.st_mode) && file_stat.st_size >= BACKGROUND_READ_SIZE)
+		{
+			start_loading(state->file, line1, state);
+			if(keep_indexes && state->source)
+				state->source->index = new_line_index(command->arg1.buf);
+			state->file = NULL;
+			break;
+		}
+		/* Pipes and FIFOs can't be loaded in the background, since there's no telling how long they are, but they can be read much faster than a character at a time */
+		if(S_ISFIFO(file_stat.st_mode) || S_ISSOCK(file_stat.st_mode) || (S_ISCHR(file_stat.st_mode) && !isatty(fileno(state->file))))
+			input_lines = stream_lines(state->file, &num_lines, state);
+		else
+			input_lines = get_lines(&num_lines, 1, state);
+		long num_bytes = 0;
+		for (long i = 0; i < num_lines; i++)
 		{
 			num_bytes += input_lines[i].length;
 		}
-		int num_words = num_bytes / 3;
+		long num_words = num_bytes / 3;
 		if (num_bytes % 3)
 			num_words++;
-		state->dollar++;
-		state->main_buffer = replace_elements_in_string_vector(state->main_buffer, &state->dollar, input_lines, num_lines, line1, 0);
-		state->dollar--;
+		/* A file read into an empty buffer becomes its source, unless its tabs were expanded */
+		int track = S_ISREG(file_stat.st_mode) && !state->dollar && !state->tabs_set;
+		unsigned long hash = 0;
+		for(i = 0; track && keep_indexes && i < num_lines; i++)
+			hash = hash_line(hash, &input_lines[i]);
+		replace_lines(state, input_lines, num_lines, line1, 0);
+		mem_free(input_lines, MEM_LINES);
+		if(track)
+		{
+			start_source(state, fileno(state->file));
+			source_lines(state, line1, num_lines, 0);
+			check_source(state, fileno(state->file), num_bytes, line1 + num_lines - 1);
+			if(keep_indexes && state->source)
+			{
+				state->source->index = new_line_index(command->arg1.buf);
+				finish_index(state, hash);
+			}
+		}
 		state->dot = line1 + num_lines - 1;
 		fclose(state->file);
 		state->file = NULL;
-		printf("%i WORDS.\r\n", num_words);
+		fprintf(term_out, "%li WORDS.\r\n", num_words);
 		break;
 	case 'W':
-		if(!(state->file = fopen(command->arg1.buf, "w")))
+		long bytes_written = 0;
+		/* Writing the whole buffer back to the file it came from only needs to write what has changed */
+		n = (command->start || command->end)?0:write_changes(command->arg1.buf, &bytes_written, state);
+		if(n < 0 || (!n && !(state->file = fopen(command->arg1.buf, "w"))))
 		{
 			err(state);
-			printf("I-O ERROR.\r\n");
+			fprintf(term_out, "I-O ERROR.\r\n");
 			return 0;
 		}
+		if(n)
+		{
+			fprintf(term_out, "%li WORDS.\r\n", bytes_written/3 + (bytes_written%3 != 0));
+			break;
+		}
 		if(!(command->start || command->end))
 		{
 			line1 = 1;
 			line2 = state->dollar;
 		}
-		int bytes_written = 0;
 		for(i = line1; i <= line2; i++)
 		{
-			fprintf(state->file, "%s", state->main_buffer[i].buf);
+			fprintf(state->file, "%s", get_line(i, state)->buf);
 			bytes_written += state->main_buffer[i].length;
 		}
+		fflush(state->file);
+		/* A file the whole buffer was written to becomes its source. Writing part of the buffer over the source makes it no longer one */
+		struct stat written_stat;
+		if(!(command->start || command->end))
+		{
+			start_source(state, fileno(state->file));
+			source_lines(state, 1, state->dollar, 0);
+		}
+		else if(state->source && !fstat(fileno(state->file), &written_stat) && written_stat.st_dev == state->source->device && written_stat.st_ino == state->source->inode)
+		{
+			free_source(state->source);
+			state->source = NULL;
+		}
 		fclose(state->file);
 		state->file = NULL;
-		int words_written = bytes_written/3;
+		long words_written = bytes_written/3;
 		if (bytes_written%3)
 			words_written++;
-		printf("%i WORDS.\r\n", words_written);
+		fprintf(term_out, "%li WORDS.\r\n", words_written);
+		break;
+	case '!':
+		if(!(command->start || command->end))
+		{
+			line1 = 1;
+			line2 = state->dollar;
+		}
+		if(!filter_lines(command->arg1.buf, line1, line2, &input_lines, &num_lines, state))
+		{
+			err(state);
+			fprintf(term_out, "I-O ERROR.\r\n");
+			return 0;
+		}
+		long filtered_bytes = 0;
+		for(i = 0; i < num_lines; i++)
+			filtered_bytes += input_lines[i].length;
+		replace_lines(state, input_lines, num_lines, line1, line2-line1+1);
+		mem_free(input_lines, MEM_LINES);
+		state->dot = line1 + num_lines - 1;
+		long filtered_words = filtered_bytes/3;
+		if (filtered_bytes%3)
+			filtered_words++;
+		fprintf(term_out, "%li WORDS.\r\n", filtered_words);
+		break;
+	case 'N':
+		state->patterns = command->flag == 'P';
+		break;
+	case 'O':
+		if(!(command->start || command->end))
+		{
+			line1 = 1;
+			line2 = state->dollar;
+		}
+		state->dot = line1 + order_lines(line1, line2, command->num, state) - 1;
+		break;
+	case 'X':
+		if(!(command->start || command->end))
+		{
+			line1 = 1;
+			line2 = state->dollar;
+		}
+		finished = every_line(command, line1, line2, state);
 		break;
 	case 'S':
-		n = substitute(&command->arg1, &command->arg2, line1, line2, command->flag, command->num, state);
+		if(command->flag == 'T')
+		{
+			struct replace_table *table = load_table(command, state);
+			if(!table)
+				return 0;
+			n = substitute_table(table, line1, line2, command->num, state);
+			if(n)
+				report_table(table);
+			free_table(table);
+		}
+		else
+		{
+			struct pattern *pattern = state->patterns?new_pattern(&command->arg2, 0):NULL;
+			n = state->patterns && !pattern?0:substitute(&command->arg1, &command->arg2, pattern, line1, line2, command->flag, command->num, state);
+			free_pattern(pattern);
+		}
 		if(n == 0)
 			err(state);
 		else
-			printf("%i\r\n", n);
+			fprintf(term_out, "%li\r\n", n);
 		break;
 	case 'J':
 		get_string(&buffer, '\0', 1, 1, 0, 0, NULL, state);
@@ -1447,18 +5348,38 @@ int execute_command(struct command_spec *command, struct state_spec *state)
 		buffer.length--;
 		buffer.buf[buffer.length] = '\0';
 		if(buffer.length > 0 && buffer.buf[buffer.length-1] != '\r')
-			printf("\r\n");
+			fprintf(term_out, "\r\n");
 		set_buffer(buffer_for_char(command->arg1.buf[0]), &buffer, state);
+		delete_string(&buffer);
 		break;
 	case 'K':
 		kill_buffer(buffer_for_char(command->arg1.buf[0]), state);
 		break;
+	case 'U':
+		if(!command->start)
+			line1 = state->dollar;
+		input_lines = buffer_lines(buffer_for_char(command->arg1.buf[0]), &num_lines, state);
+		replace_lines(state, input_lines, num_lines, line1+1, 0);
+		mem_free(input_lines, MEM_LINES);
+		state->dot = line1 + num_lines;
+		break;
 	case 'B':
-		if(state->aux_buffers[buffer_for_char(command->arg1.buf[0])].buf)
+		n = buffer_for_char(command->arg1.buf[0]);
+		if(state->aux_spans[n].lines)
+		{
+			/* Print the lines straight from the span list rather than joining them; \n prints the same as the \r they'd be joined with */
+			fprintf(term_out, "\"");
+			for(i = 0; i < state->aux_spans[n].num_lines; i++)
+			{
+				print_string(&state->aux_spans[n].lines[i]);
+			}
+			fprintf(term_out, "\"\r\n");
+		}
+		else if(state->aux_buffers[n].buf)
 		{
-			printf("\"");
-			print_string(&state->aux_buffers[buffer_for_char(command->arg1.buf[0])]);
-			printf("\"\r\n");
+			fprintf(term_out, "\"");
+			print_string(&state->aux_buffers[n]);
+			fprintf(term_out, "\"\r\n");
 		}
 		break;
 	case 'V':
@@ -1469,17 +5390,40 @@ int execute_command(struct command_spec *command, struct state_spec *state)
 		cmd_strings = cmd_strings_quick;
 		state->quick = 1;
 		break;
+	case 'T':
+		if(!command->arg1.length)
+			print_tabs(state);
+		else if(set_tabs(command->arg1.buf, state))
+			state->tabs_set = 1;
+		else
+			err(state);
+		break;
+	case 'H':
+		report_heap(state);
+		break;
+	case 'Y':
+		yield_memory(state);
+		break;
 	case 'F':
 			return 1;
 	default:
-		printf("[not implemented yet]\r\n");
+		fprintf(term_out, "[not implemented yet]\r\n");
+	}
+	make_room(state);
+	/* Lines that couldn't be paged out are still in memory, so the command went through, but the user should know to write out */
+	if(pager.failed)
+	{
+		pager.failed = 0;
+		err(state);
+		fprintf(term_out, "I-O ERROR.\r\n");
 	}
 	state->wrote_out = (command->command == 'W');
-	return 0;
+	return finished;
 }
 void dump_state(struct state_spec *state)
 {
 	FILE *statefile;
+	finish_loading(state);
 	if (!(statefile = fopen(dumpfile, "w")))
 	{
 		err(state);
@@ -1490,57 +5434,59 @@ void dump_state(struct state_spec *state)
 	// Write dumpfile format revision number
 	fwrite(&dumprev, 1, sizeof(int), statefile);
 	// Write dot and dollar
-	fwrite(&state->dot, 1, sizeof(int), statefile);
-	fwrite(&state->dollar, 1, sizeof(int), statefile);
-	fwrite(&state->quick, 1, sizeof(int), statefile);
+	write_number(state->dot, statefile);
+	write_number(state->dollar, statefile);
+	write_number(state->quick, statefile);
 	// Write the aux buffers
 	for(int i=0; i<NUM_AUX_BUFS; i++)
 	{
-		fwrite(&state->aux_buffers[i].length, 1, sizeof(int), statefile);
-		if (state->aux_buffers[i].length > 0)
+		struct string *buffer = aux_buffer(i, state);
+		write_number(buffer->length, statefile);
+		if (buffer->length > 0)
 		{
-			fwrite(state->aux_buffers[i].buf, state->aux_buffers[i].length, 1, statefile);
+			fwrite(buffer->buf, buffer->length, 1, statefile);
 		}
 	}
-	for(int i = 1; i <= state->dollar; i++)
+	for(long i = 1; i <= state->dollar; i++)
 	{
-		fwrite(state->main_buffer[i].buf, state->main_buffer[i].length, 1, statefile);
+		struct string *line = get_line(i, state);
+		fwrite(line->buf, line->length, 1, statefile);
 	}
+	fclose(statefile);
 }
 struct state_spec* restore_state()
 {
 	FILE *statefile;
 	if (!(statefile = fopen(dumpfile, "r")))
 	{
-		printf("IO-ERROR.\r\nCould not read continue file at %s\r\n", dumpfile);
+		fprintf(term_out, "IO-ERROR.\r\nCould not read continue file at %s\r\n", dumpfile);
 		return NULL;
 	}
-	char *sig = malloc(4);
-	bzero(sig, 4);
+	char sig[4] = {0};
 	fread(sig, 3, 1, statefile);
 	if (strcmp(sig, "QED"))
 	{
-		printf("Invalid signature in continue file\r\n");
+		fprintf(term_out, "Invalid signature in continue file\r\n");
 		return NULL;
 	}
 	int f_rev = 0;
 	fread(&f_rev, 1, sizeof(int), statefile);
-	struct state_spec *state = malloc(sizeof(struct state_spec));
-	//printf("%i\r\n", f_rev);
+	struct state_spec *state = mem_alloc(sizeof(struct state_spec), MEM_OTHER);
+	//fprintf(term_out, "%i\r\n", f_rev);
 	if(f_rev != dumprev)
 	{
-		printf("Incorrect continue file version (found %i, expected %i)\r\n", f_rev, dumprev);
+		fprintf(term_out, "Incorrect continue file version (found %i, expected %i)\r\n", f_rev, dumprev);
 		return NULL;
 	}
-	fread(&state->dot, 1, sizeof(int), statefile);
-	fread(&state->dollar, 1, sizeof(int), statefile);
-	fread(&state->quick, 1, sizeof(int),statefile);
-	state->aux_buffers = calloc(sizeof(struct string), NUM_AUX_BUFS);
+	state->dot = read_number(statefile);
+	state->dollar = read_number(statefile);
+	state->quick = read_number(statefile);
+	state->aux_buffers = mem_calloc(sizeof(struct string), NUM_AUX_BUFS, MEM_OTHER);
+	state->aux_spans = mem_calloc(sizeof(struct span_list), NUM_AUX_BUFS, MEM_OTHER);
 	for(int i=0; i < NUM_AUX_BUFS; i++)
 	{
-		int bsize = 0;
-		fread(&bsize, 1, sizeof(int), statefile);
-		//printf("B%i: %i bytes\r\n", i, bsize);
+		long bsize = read_number(statefile);
+		//fprintf(term_out, "B%i: %li bytes\r\n", i, bsize);
 		string_with_capacity(&state->aux_buffers[i], bsize);
 		if (!bsize)
 		{
@@ -1549,13 +5495,13 @@ struct state_spec* restore_state()
 		read_string_from_file(&state->aux_buffers[i], bsize, statefile);
 		if (state->aux_buffers[i].length < bsize)
 		{
-			printf("EOF encountered while loading buffer %i from continue file(expected %i, got %i)\r\n", i, bsize, state->aux_buffers[i].length);
+			fprintf(term_out, "EOF encountered while loading buffer %i from continue file(expected %li, got %li)\r\n", i, bsize, state->aux_buffers[i].length);
 			return NULL;
 		}
 	}
 	state->file = statefile;
-	state->main_buffer = calloc(sizeof(struct string), 1);
-	int input_length = 0;
+	state->main_buffer = mem_calloc(sizeof(struct string), 1, MEM_LINES);
+	long input_length = 0;
 	struct string *lines = get_lines(&input_length, 1, state);
 	fclose(statefile);
 	state->file = NULL;
@@ -1564,12 +5510,247 @@ struct state_spec* restore_state()
 	state->dollar -= 1;
 	state->wrote_out = 1;
 	state->buffer_stack = NULL;
+	memset(&state->paste, 0, sizeof(struct string));
+	state->paste_pos = 0;
+	state->loader = NULL;
+	state->loaded_words = -1;
+	state->errors = 0;
+	set_tabs((char *)default_tabs, state);
+	state->tabs_set = 0;
+	state->searches = NULL;
+	state->source = NULL;
+	state->marks = NULL;
+	state->num_marks = 0;
+	state->patterns = 0;
+	return state;
+}
+struct state_spec *new_state_spec()
+/* Constructor for the state of a new editing session, with empty buffers */
+{
+	struct state_spec *state = mem_alloc(sizeof(struct state_spec), MEM_OTHER);
+	state->main_buffer = mem_calloc(sizeof(struct string), 1, MEM_LINES);
+	state->aux_buffers = mem_calloc(sizeof(struct string), NUM_AUX_BUFS, MEM_OTHER);
+	state->aux_spans = mem_calloc(sizeof(struct span_list), NUM_AUX_BUFS, MEM_OTHER);
+	state->dollar = 0;
+	state->dot = 0;
+	state->file = NULL;
+	state->quick = 0;
+	state->wrote_out = 1;
+	state->buffer_stack = NULL;
+	memset(&state->paste, 0, sizeof(struct string));
+	state->paste_pos = 0;
+	state->loader = NULL;
+	state->loaded_words = -1;
+	state->errors = 0;
+	set_tabs((char *)default_tabs, state);
+	state->tabs_set = 0;
+	state->searches = NULL;
+	state->source = NULL;
+	state->marks = NULL;
+	state->num_marks = 0;
+	state->patterns = 0;
 	return state;
 }
+int serve(char *path, struct state_spec *shared)
+/* Runs qed as a server on a Unix domain socket at path, keeping the main buffer in shared between clients so that a big file only has to be read once.
+   A client sends requests of the form <length>\n<keystrokes>, where the keystrokes are one or more whole commands typed just as they would be at the
+   terminal, and gets back for each a response of the form OK <length>\n<output> (ERROR in place of OK if a command failed) holding what qed typed
+   while running them, without the echo of the commands themselves. FINISHED ends the client's session rather than the server */
+{
+	struct sockaddr_un addr;
+	struct client *clients = NULL;
+	int num_clients = 0;
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+	unlink(path);
+	if(listener < 0 || strlen(path) >= sizeof(addr.sun_path) || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) || listen(listener, 16))
+	{
+		fprintf(term_out, "I-O ERROR.\r\n");
+		return 1;
+	}
+	scripted = 1;
+	signal(SIGPIPE, SIG_IGN);
+	while(1)
+	{
+		struct pollfd fds[num_clients+1];
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for(int i = 0; i < num_clients; i++)
+		{
+			fds[i+1].fd = clients[i].fd;
+			fds[i+1].events = POLLIN;
+		}
+		/* While a background READ FROM is going, wake up now and then to take in what it has loaded */
+		if(poll(fds, num_clients+1, shared->loader?100:-1) < 0 && errno != EINTR)
+			break;
+		if(shared->loader)
+			absorb_lines(shared, 0);
+		/* Go through the clients backwards, so that one that has gone can be replaced by the last one, which has already been seen to */
+		for(int i = num_clients-1; i >= 0; i--)
+		{
+			if(fds[i+1].revents && !read_request(&clients[i], shared))
+			{
+				close(clients[i].fd);
+				clients[i].state->main_buffer = NULL;
+				clients[i].state->dollar = -1;
+				clients[i].state->source = NULL;
+				free_state_spec(clients[i].state);
+				delete_string(&clients[i].request);
+				clients[i] = clients[--num_clients];
+			}
+		}
+		if(fds[0].revents & POLLIN)
+		{
+			int fd = accept(listener, NULL, NULL);
+			if(fd < 0)
+				continue;
+			clients = mem_realloc(clients, (num_clients+1) * sizeof(struct client), MEM_OTHER);
+			clients[num_clients].fd = fd;
+			clients[num_clients].state = new_state_spec();
+			mem_free(clients[num_clients].state->main_buffer, MEM_LINES);
+			memset(&clients[num_clients].request, 0, sizeof(struct string));
+			num_clients++;
+		}
+	}
+	return 1;
+}
+int read_request(struct client *client, struct state_spec *shared)
+/* Reads whatever the client has sent and serves each whole request in it. Returns 0 once the client has gone away or FINISHED */
+{
+	struct string *request = &client->request;
+	reserve_space(request, request->length + 65536);
+	long n = read(client->fd, request->buf + request->length, 65536);
+	if(n <= 0)
+		return 0;
+	request->length += n;
+	while(1)
+	{
+		char *newline = memchr(request->buf, '\n', request->length);
+		if(!newline)
+			return 1;
+		char *text = newline+1;
+		long length = atol(request->buf);
+		if(length < 0)
+			return 0;
+		if(text - request->buf + length > request->length)
+			return 1;
+		int finished = serve_request(client, text, length, shared);
+		long used = text - request->buf + length;
+		memmove(request->buf, request->buf + used, request->length - used);
+		request->length -= used;
+		if(finished)
+			return 0;
+	}
+}
+int serve_request(struct client *client, char *text, long length, struct state_spec *shared)
+/* Runs the commands in one request from a client on the shared main buffer and sends the client the response. Returns 1 if the client FINISHED */
+{
+	struct state_spec *state = client->state;
+	char *response = NULL;
+	size_t response_length = 0;
+	char header[64];
+	FILE *out = open_memstream(&response, &response_length);
+	state->main_buffer = shared->main_buffer;
+	state->dollar = shared->dollar;
+	state->loader = shared->loader;
+	state->loaded_words = shared->loaded_words;
+	state->wrote_out = shared->wrote_out;
+	state->source = shared->source;
+	if(state->dot > state->dollar)
+		state->dot = state->dollar;
+	int finished = run_commands(text, length, out, state);
+	shared->main_buffer = state->main_buffer;
+	shared->dollar = state->dollar;
+	shared->loader = state->loader;
+	shared->loaded_words = state->loaded_words;
+	shared->wrote_out = state->wrote_out;
+	shared->source = state->source;
+	fclose(out);
+	write_all(client->fd, header, snprintf(header, sizeof(header), "%s %zu\n", state->errors?"ERROR":"OK", response_length));
+	write_all(client->fd, response, response_length);
+	free(response);
+	return finished;
+}
+int run_commands(char *text, long length, FILE *out, struct state_spec *state)
+/* Runs the commands typed in the first length characters of text, as for a server request or qed_run, with whatever qed types in response
+   going to out and the echo of the commands themselves thrown away. state->errors is left counting the commands that failed. Returns 1 if one of them was FINISHED */
+{
+	struct command_spec *command;
+	int finished = 0;
+	term_in = length?fmemopen(text, length, "r"):NULL;
+	term_out = out;
+	cmd_strings = state->quick?cmd_strings_quick:cmd_strings_verbose;
+	state->errors = 0;
+	while(term_in && !finished)
+	{
+		/* Stop at the end of the text, unless a buffer being executed still has commands in it */
+		int c = state->buffer_stack?0:getc_unlocked(term_in);
+		if(c == EOF)
+			break;
+		if(!state->buffer_stack)
+			ungetc(c, term_in);
+		report_loading(state);
+		quiet = 1;
+		command = get_command(state);
+		quiet = 0;
+		if(command != NULL)
+		{
+			finished = execute_command(command, state);
+			free_command_spec(command);
+		}
+		else
+		{
+			err(state);
+			fprintf(term_out, "\r\n");
+		}
+	}
+	free_buffer_stack(state->buffer_stack);
+	state->buffer_stack = NULL;
+	if(term_in)
+		fclose(term_in);
+	term_in = stdin;
+	term_out = stdout;
+	return finished;
+}
+int input_cut_off(struct state_spec *state)
+/* Tells whether the commands given to run_commands ran out while lines were being typed for APPEND, INSERT or CHANGE, before the ^D ending them.
+   The lines of a request cut off like that are thrown away rather than added, since the request fails */
+{
+	return term_in != stdin && !state->file && feof(term_in);
+}
+void write_all(int fd, char *buf, long length)
+/* Writes all length bytes of buf to fd, giving up if the other end has gone away */
+{
+	while(length > 0)
+	{
+		long n = write(fd, buf, length);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return;
+		buf += n;
+		length -= n;
+	}
+}
+void write_number(long n, FILE *f)
+/* Writes n to the continue file f as a 64-bit number, so that line numbers and buffer lengths aren't cut short whatever the size of an int */
+{
+	int64_t number = n;
+	fwrite(&number, 1, sizeof(int64_t), f);
+}
+long read_number(FILE *f)
+/* Reads a number written by write_number from the continue file f. Returns 0 if there isn't one */
+{
+	int64_t number = 0;
+	fread(&number, 1, sizeof(int64_t), f);
+	return number;
+}
 struct string *new_string()
 /* Allocates and clears a new null string */
 {
-	struct string *s = malloc(sizeof(struct string));
+	struct string *s = mem_alloc(sizeof(struct string), MEM_STRINGS);
 	s->length = 0;
 	s->space = 0;
 	s->buf = NULL;
@@ -1582,16 +5763,16 @@ struct string *empty_string(struct string *s)
 		s = new_string();
 	s->length = 0;
 	s->space = BUF_INCREMENT;
-	s->buf = malloc(BUF_INCREMENT);
+	s->buf = scratch?arena_alloc(scratch, BUF_INCREMENT+1):mem_alloc(BUF_INCREMENT, MEM_STRINGS);
 	return s;
 }
-struct string *string_with_capacity(struct string *s, int space)
+struct string *string_with_capacity(struct string *s, long space)
 /* Creates a blank string with allocated capacity for the specified number of characters. One byte is added to hold the terminating \0. If s is null, a new string is allocated. Return value is s or the new string */
 {
 	if(!s)
 		s = new_string();
 	s->length = 0;
-	s->buf = malloc(space+1);
+	s->buf = mem_alloc(space+1, MEM_STRINGS);
 	s->buf[0] = '\0';
 	s->space = space;
 	return s;
@@ -1601,21 +5782,19 @@ struct string *string_from_cstring(struct string *s, char *cs)
 {
 	if(!s)
 		s = new_string();
-	if(s->buf)
-		free(s->buf);
-	int l = strlen(cs);
+	free_buf(s);
+	long l = strlen(cs);
 	s->length = s->space = l;
-	s->buf = malloc(l+1);
+	s->buf = scratch?arena_alloc(scratch, l+1):mem_alloc(l+1, MEM_STRINGS);
 	strncpy(s->buf, cs, l);
 	return s;
 }
-struct string *capture_cstring(struct string *s, char *cs, int space)
+struct string *capture_cstring(struct string *s, char *cs, long space)
 /* Captures the c-string cs, making s its owner. A new string will be allocated if s is NULL. Returns s or the new string. If space is non-zero, it will be used for the "space" parameter for s (i.e. the allocation length-1); otherwise the length of cs will be assumed for this. If a non-zero value of space is provided, it is up to the caller to make sure it is accurate */
 {
 	if (!s)
 		s = new_string();
-	if(s->buf)
-		free(s->buf);
+	free_buf(s);
 	s->buf = cs;
 	s->length = strlen(cs);
 	s->space = space?space:s->length;
@@ -1626,8 +5805,7 @@ void delete_string(struct string *s)
 {
 	if(!s)
 		return;
-	if(s->buf)
-		free(s->buf);
+	free_buf(s);
 	s->buf = NULL;
 	s->space = 0;
 	s->length = 0;
@@ -1637,43 +5815,36 @@ void free_string(struct string *s)
 {
 	if (!s)
 		return;
-	if (s->buf)
-		free(s->buf);
-	free(s);
+	free_buf(s);
+	mem_free(s, MEM_STRINGS);
 }
 struct string *copy_string(struct string *dst, struct string *src, int copy_space)
 /* Copies the contents of src to dst, replacing existing contents. If copy_space is true, dst will be left with as much extra space as src had. If dst is NULL, a new string will be allocated. Returns dst or the new string */
 {
 	if (!dst)
 		dst = new_string();
-	int dst_space = copy_space?src->space:src->length;
-	if(dst->buf)
-		free(dst->buf);
-	dst->buf = malloc(dst_space+1);
+	long dst_space = (copy_space && src->space != SHARED)?src->space:src->length;
+	free_buf(dst);
+	dst->buf = mem_alloc(dst_space+1, MEM_STRINGS);
 	memcpy(dst->buf, src->buf, src->length+1);
 	dst->length = src->length;
 	dst->space = dst_space;
 	return dst;
 }
-struct string *cat_slice(struct string *dst, struct string *src, int start, int length)
+struct string *cat_slice(struct string *dst, struct string *src, long start, long length)
 /* Copies a segment of the string src to the end of dst. If dst is NULL, a new string will be allocated. Returns dst or the new string. Start is the index of the first char to be copied, length is the number of chars to copy. If length is negative, the copy will be to the end of src. The copy will be trimmed to the length of src. */
 {
 	if (!dst)
 		dst = new_string();
 	if (start >= src->length)
 		return dst;
-	int max_length = src->length - start;
-	int cpy_length;
+	long max_length = src->length - start;
+	long cpy_length;
 	if (length < 0 || length > max_length)
 		cpy_length = max_length;
 	else
 		cpy_length = length;
-	int space_needed = src->length + cpy_length;
-	if (space_needed > dst->space)
-	{
-		dst->buf = realloc(dst->buf, space_needed+1);
-		dst->space = space_needed;
-	}
+	reserve_space(dst, dst->length + cpy_length);
 	memcpy(dst->buf+dst->length, src->buf+start, cpy_length);
 	dst->length += cpy_length;
 	dst->buf[dst->length] = '\0';
@@ -1682,12 +5853,8 @@ struct string *cat_slice(struct string *dst, struct string *src, int start, int
 void cat_strings(struct string *s1, struct string *s2)
 /* Concatenates two strings. The string s1 is modified by adding a copy of the contents of s2 to the end. The string s2 is not changed. */
 {
-	int req_len = s1->length + s2->length;
-	if (s1->space < req_len)
-	{
-		s1->buf = realloc(s1->buf, req_len+1);
-		s1->space = req_len;
-	}
+	long req_len = s1->length + s2->length;
+	reserve_space(s1, req_len);
 	memcpy(s1->buf+s1->length, s2->buf, s2->length);
 	s1->buf[req_len] = '\0';
 	s1->length = req_len;
@@ -1698,17 +5865,289 @@ int print_string(struct string *s)
 		return 0;
 	return print_buffer(s->buf);
 }
-struct string *read_string_from_file(struct string *s, int length, FILE *f)
+struct string *read_string_from_file(struct string *s, long length, FILE *f)
 /* Reads a string of length <length> into the string s from the file f. If s is NULL a new string will be allocated. The capacity of s will be expanded if needed. Returns s or the new string. If the file reached EOF before <length> bytes were read, s may be smaller then <length> */
 {
 	if (!s)
 		s = new_string();
-	if (s->space < length)
-	{
-		s->buf = realloc(s->buf, length+1);
-		s->space = length;
-	}
+	reserve_space(s, length);
 	s->length = fread(s->buf, 1, length, f);
 	s->buf[s->length] = '\0';
 	return s;
 }
+void reserve_space(struct string *s, long space)
+/* Makes sure s owns a buffer with room for at least space characters plus the terminating \0, reallocating it if needed. If the text of s is SHARED, s is first given its own private copy of it */
+{
+	if (s->space == SHARED)
+	{
+		char *buf = mem_alloc((space > s->length?space:s->length)+1, MEM_STRINGS);
+		memcpy(buf, s->buf, s->length+1);
+		release_text(s->buf);
+		s->buf = buf;
+		s->space = space > s->length?space:s->length;
+	}
+	else if (scratch && s->buf && in_arena(scratch, s->buf))
+	{
+		/* A string being typed into a command. Its buffer grows in place if nothing has been allocated after it; otherwise it moves, so it doubles to make that rare */
+		if (s->space < space)
+		{
+			if (space < s->space * 2)
+				space = s->space * 2;
+			s->buf = arena_grow(scratch, s->buf, s->space+1, space+1);
+			s->space = space;
+		}
+	}
+	else if (s->space < space || !s->buf)
+	{
+		/* A string that is growing doubles, so that one built up a character at a time, such as a long line being typed or copied, isn't copied over and over */
+		if (s->buf && space < s->space * 2)
+			space = s->space * 2;
+		s->buf = mem_realloc(s->buf, space+1, MEM_STRINGS);
+		s->space = space;
+	}
+}
+void free_buf(struct string *s)
+/* Frees the buffer of s, or drops its reference to the buffer if the text is SHARED. Does not touch the other members of s */
+{
+	if (s->space == SWAPPED)
+		swap_ref(s->swap_offset, -1);
+	if (!s->buf || s->space == SWAPPED)
+		return;
+	if (s->space == SHARED)
+		release_text(s->buf);
+	else if (!scratch || !in_arena(scratch, s->buf))
+		mem_free(s->buf, MEM_STRINGS);
+}
+struct line_text *text_header(char *buf)
+/* Returns the line_text header of a SHARED string's buffer */
+{
+	return (struct line_text *)(buf - offsetof(struct line_text, text));
+}
+unsigned int hash_text(char *buf, long length)
+/* FNV-1a hash of the first length characters of buf */
+{
+	unsigned int h = 2166136261u;
+	for (long i = 0; i < length; i++)
+	{
+		h ^= (unsigned char)buf[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+struct string *intern_string(struct string *s)
+/* Turns s into a SHARED string, as is done for every line stored in the main buffer. If interning is on and identical text is already in the intern table, s just takes a reference to it; otherwise the text is moved into a new line_text of exactly the right size. Returns s */
+{
+	char *buf = s->buf;
+	if (!buf || s->space == SHARED || s->space == SWAPPED)
+		return s;
+	s->buf = NULL;
+	intern_slice(s, buf, s->length);
+	mem_free(buf, MEM_STRINGS);
+	return s;
+}
+struct string *intern_slice(struct string *s, char *text, long length)
+/* Makes the empty string s a SHARED string holding a copy of the first length characters of text, or a reference to identical interned text if there is any. Returns s */
+{
+	struct line_text *t;
+	unsigned int h = 0;
+	s->length = length;
+	s->space = SHARED;
+	if (intern_lines)
+	{
+		h = hash_text(text, length);
+		if (line_pool.buckets)
+		{
+			for (t = line_pool.buckets[h % line_pool.num_buckets]; t; t = t->next)
+			{
+				if (t->hash == h && !strncmp(t->text, text, length) && !t->text[length])
+				{
+					t->refs++;
+					s->buf = t->text;
+					return s;
+				}
+			}
+		}
+	}
+	t = mem_alloc(sizeof(struct line_text) + length + 1, MEM_TEXT);
+	t->refs = 1;
+	t->hash = h;
+	t->next = NULL;
+	t->swap_offset = -1;
+	memcpy(t->text, text, length);
+	t->text[length] = '\0';
+	s->buf = t->text;
+	pager.resident += length;
+	if (intern_lines)
+	{
+		/* Table is full; double the number of buckets */
+		if (line_pool.count >= line_pool.num_buckets)
+			resize_intern_table(line_pool.num_buckets?line_pool.num_buckets*2:INTERN_BUCKETS);
+		t->next = line_pool.buckets[h % line_pool.num_buckets];
+		line_pool.buckets[h % line_pool.num_buckets] = t;
+		line_pool.count++;
+	}
+	return s;
+}
+void resize_intern_table(long num_buckets)
+/* Rehashes everything in the intern table into the given number of buckets */
+{
+	struct line_text **new_buckets = mem_calloc(sizeof(struct line_text *), num_buckets, MEM_OTHER);
+	for (long i = 0; i < line_pool.num_buckets; i++)
+	{
+		struct line_text *next;
+		for (struct line_text *e = line_pool.buckets[i]; e; e = next)
+		{
+			next = e->next;
+			e->next = new_buckets[e->hash % num_buckets];
+			new_buckets[e->hash % num_buckets] = e;
+		}
+	}
+	mem_free(line_pool.buckets, MEM_OTHER);
+	line_pool.buckets = new_buckets;
+	line_pool.num_buckets = num_buckets;
+}
+struct string *share_string(struct string *dst, struct string *src)
+/* Makes dst hold the same text as src. If src is SHARED this only takes another reference to its text; otherwise the text is copied as with copy_string. If dst is NULL, a new string will be allocated. Returns dst or the new string */
+{
+	if (src->space != SHARED)
+		return copy_string(dst, src, 0);
+	if (!dst)
+		dst = new_string();
+	text_header(src->buf)->refs++;
+	free_buf(dst);
+	dst->buf = src->buf;
+	dst->length = src->length;
+	dst->space = SHARED;
+	return dst;
+}
+void release_text(char *buf)
+/* Drops one reference to the SHARED text buf, freeing it (and removing it from the intern table) when no references remain */
+{
+	struct line_text *t = text_header(buf);
+	if (--t->refs > 0)
+		return;
+	pager.resident -= strlen(t->text);
+	if (intern_lines && line_pool.buckets)
+	{
+		struct line_text **e = &line_pool.buckets[t->hash % line_pool.num_buckets];
+		while (*e && *e != t)
+			e = &(*e)->next;
+		if (*e)
+		{
+			*e = t->next;
+			line_pool.count--;
+		}
+	}
+	mem_free(t, MEM_TEXT);
+}
+/* An editing session driven through libqed; see qed.h */
+struct qed {
+	struct state_spec *state;
+	char *output;  /* What the last qed_run typed */
+	size_t output_length;
+};
+struct qed *qed_open(void)
+/* libqed constructor for a new editing session */
+{
+	struct qed *qed = mem_alloc(sizeof(struct qed), MEM_OTHER);
+	if(!qed)
+		return NULL;
+	if(!term_out)
+	{
+		term_in = stdin;
+		term_out = stdout;
+	}
+	scripted = 1;
+	qed->state = new_state_spec();
+	qed->output = NULL;
+	qed->output_length = 0;
+	return qed;
+}
+void qed_close(struct qed *qed)
+/* libqed destructor */
+{
+	finish_loading(qed->state);
+	free_state_spec(qed->state);
+	free(qed->output);
+	mem_free(qed, MEM_OTHER);
+	free_arena(&parser_arena);
+}
+long qed_load(struct qed *qed, const char *text, long length, long after)
+/* Splits text into lines and puts them in the main buffer after the given line, without going through get_string a character at a time as READ FROM does */
+{
+	struct state_spec *state = qed->state;
+	long num_lines;
+	finish_loading(state);
+	if(after < 0 || after > state->dollar)
+		return -1;
+	struct string *lines = split_lines((char *)text, length, '\n', &num_lines);
+	replace_lines(state, lines, num_lines, after+1, 0);
+	mem_free(lines, MEM_LINES);
+	state->dot = after + num_lines;
+	make_room(state);
+	return num_lines;
+}
+long qed_address(struct qed *qed, const char *address)
+/* Resolves an address by reading it, followed by =, as a command and resolving that command's address without running it */
+{
+	struct state_spec *state = qed->state;
+	long length = strlen(address);
+	long line = -1;
+	char *keys = mem_alloc(length+1, MEM_OTHER);
+	memcpy(keys, address, length);
+	keys[length] = '=';
+	term_in = fmemopen(keys, length+1, "r");
+	quiet = 1;
+	struct command_spec *command = term_in?get_command(state):NULL;
+	quiet = 0;
+	if(command && command->start)
+		line = resolve_line_spec(command->start, state);
+	if(command)
+		free_command_spec(command);
+	if(term_in)
+		fclose(term_in);
+	term_in = stdin;
+	term_out = stdout;
+	mem_free(keys, MEM_OTHER);
+	return line;
+}
+long qed_run(struct qed *qed, const char *keys, long length)
+/* Runs commands for libqed, keeping what they typed in the session's output */
+{
+	free(qed->output);
+	qed->output = NULL;
+	qed->output_length = 0;
+	FILE *out = open_memstream(&qed->output, &qed->output_length);
+	int finished = run_commands((char *)keys, length, out, qed->state);
+	fclose(out);
+	return finished?-1:qed->state->errors;
+}
+const char *qed_output(struct qed *qed, long *length)
+/* Returns the output of the last qed_run */
+{
+	*length = qed->output_length;
+	return qed->output?qed->output:"";
+}
+const char *qed_line(struct qed *qed, long line, long *length)
+/* Returns a line of the main buffer for libqed, reading it back in first if it has been paged out */
+{
+	struct state_spec *state = qed->state;
+	if(line > state->dollar)
+		finish_loading(state);
+	if(line < 1 || line > state->dollar)
+		return NULL;
+	struct string *s = get_line(line, state);
+	*length = s->length;
+	return s->buf;
+}
+long qed_dollar(struct qed *qed)
+/* Returns $ for libqed, once any background READ FROM has finished */
+{
+	finish_loading(qed->state);
+	return qed->state->dollar;
+}
+long qed_dot(struct qed *qed)
+/* Returns dot for libqed */
+{
+	return qed->state->dot;
+}
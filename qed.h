@@ -0,0 +1,30 @@
+/* libqed: the QED editor without the terminal
+ * Build qed.c with -DQED_NO_MAIN to get the editor as a library and include this header to drive it from C. Each struct qed is a separate
+ * editing session with its own buffers. Nothing here touches the terminal; what a command would have typed is kept for qed_output instead.
+ * The editor keeps some state in globals, so only one thread at a time may call into the library.
+ */
+#ifndef QED_H
+#define QED_H
+
+struct qed;
+
+/* Starts a new editing session with empty buffers. Returns NULL if it can't be allocated */
+struct qed *qed_open(void);
+/* Ends the session, freeing all of its buffers */
+void qed_close(struct qed *qed);
+/* Puts the first length characters of text into the main buffer after line after (0 for the top), split into lines at each \n, and leaves dot at the last of them. Returns the number of lines added, or -1 if after is past the end */
+long qed_load(struct qed *qed, const char *text, long length, long after);
+/* Resolves an address such as "$", ".+3" or "[foo]" to a line number, just as a command would, searches included. Returns -1 if the address is bad or a search fails */
+long qed_address(struct qed *qed, const char *address);
+/* Runs the commands typed in the first length characters of keys, exactly as they would be typed at the terminal (e.g. "1,$S/new/old/."), and returns how many failed with ?. What qed typed in response is kept for qed_output. Returns -1 if FINISHED was among them */
+long qed_run(struct qed *qed, const char *keys, long length);
+/* Returns what was typed in response to the last qed_run, leaving out the echo of the commands themselves, and stores its length in length. Valid until the next qed_run */
+const char *qed_output(struct qed *qed, long *length);
+/* Returns the text of the given line, ending in \n, and stores its length in length. Returns NULL if there is no such line. Valid until the session is next changed or another line is looked at */
+const char *qed_line(struct qed *qed, long line, long *length);
+/* The number of the last line, $ */
+long qed_dollar(struct qed *qed);
+/* The number of the current line, dot */
+long qed_dot(struct qed *qed);
+
+#endif
@@ -0,0 +1,278 @@
+#!/usr/bin/env python3
+# Tests for qed, run against a built binary: python3 tests/run_tests.py [--big] [path to qed, ./qed by default]
+# Each test types keystrokes into qed, at the terminal or as server requests, and checks what comes back.
+# --big also runs the slow tests on files over 2 GiB, which take a few minutes and about 7 GB of free space in the temporary directory
+import os, random, re, socket, struct, subprocess, sys, tempfile, time
+
+big = "--big" in sys.argv[1:]
+args = [arg for arg in sys.argv[1:] if arg != "--big"]
+qed = os.path.abspath(args[0] if args else "./qed")
+work = tempfile.mkdtemp()
+failures = 0
+
+def check(name, got, expected):
+	global failures
+	if got != expected:
+		failures += 1
+		print("FAIL %s: expected %r, got %r" % (name, expected, got))
+
+def write_file(name, text):
+	with open(os.path.join(work, name), "w") as f:
+		f.write(text)
+
+def typed(keys, *flags):
+	"""Types keys at qed, launched with the given flags, as if at the terminal and returns what it typed back, without the carriage returns"""
+	result = subprocess.run([qed] + list(flags), input=keys.encode(), cwd=work, capture_output=True)
+	return result.stdout.decode().replace("\r", "")
+
+def address(text, spec, dot="$"):
+	"""Reads text into the main buffer, sets dot, and returns the line number the address spec resolves to, or None if it fails"""
+	write_file("address.txt", text)
+	echo = "*%s=" % spec
+	for line in typed("R /address.txt/.%sP.N%s=\rF." % (dot, spec)).split("\n"):
+		if line.startswith(echo):
+			number = line[len(echo):]
+			return int(number) if number.isdigit() else None
+	return None
+
+def test_backward_search():
+	"""A ?? search starts from the line before dot, or before the address in front of it, even when that line matches too"""
+	text = "x one\ny\nx three\nx four\n"
+	check("?? from dot", address(text, "?x?", dot="3"), 1)
+	check("?? from $", address(text, "$?x?"), 3)
+	check(".?? when dot matches", address(text, ".?x?", dot="4"), 3)
+	check("?? wraps from line 1", address(text, "1?x?"), 4)
+	check("?? back to the addressed line", address(text, "2?y?"), 2)
+	check("?? with no match", address(text, "?z?"), None)
+
+def test_paste():
+	"""A bracketed paste into APPEND goes in whole, split at \\r, \\n or \\r\\n, and the count typed back matches the lines added"""
+	for paste, lines in [("a\rb\nc", "a\nb\nc\n"), ("a\r\nb\r\n", "a\nb\n"), ("a\n\nb\r", "a\n\nb\n"), ("one", "one\n")]:
+		output = typed("A.\x1b[200~%s\x1b[201~\x04W /paste.txt/.F." % paste)
+		check("paste %r" % paste, read_file("paste.txt"), lines)
+		check("paste %r count" % paste, "\n%d LINES PASTED.\n" % lines.count("\n") in output, True)
+
+def test_replay_parse_allocations():
+	"""Reading commands takes no heap allocations, as reported by replaying a recorded session"""
+	write_file("replay.txt", "alpha\nbeta\ngamma\n")
+	keys = "R /replay.txt/.[beta]P.N:gamma:P.N1,$S/B/b/.X/a/P.1,$P.N$=\rJC.x\x04W /replay.txt/.F."
+	subprocess.run([qed, "-r", "replay.k"], input=keys.encode(), cwd=work, capture_output=True)
+	result = subprocess.run([qed, "-R", "replay.k"], stdin=subprocess.DEVNULL, cwd=work, capture_output=True)
+	report = [line for line in result.stdout.decode().split("\r\n") if "ALLOCATIONS PER COMMAND" in line]
+	check("replay reports allocations", len(report), 1)
+	check("no allocations while reading commands", report[0].endswith(", 0.00 OF THEM WHILE READING IT.") if report else None, True)
+
+def read_file(name):
+	with open(os.path.join(work, name)) as f:
+		return f.read()
+
+def test_write_changes():
+	"""WRITE ON of the whole buffer back to the file it was read from writes only the changes, and still writes through symbolic and hard links"""
+	write_file("same.txt", "a\nb\nc\n")
+	inode = os.stat(os.path.join(work, "same.txt")).st_ino
+	typed("R /same.txt/.2C.B\x04W /same.txt/.F.")
+	check("change in place", read_file("same.txt"), "a\nB\nc\n")
+	check("change in place keeps the file", os.stat(os.path.join(work, "same.txt")).st_ino, inode)
+	write_file("longer.txt", "a\nb\nc\n")
+	typed("R /longer.txt/.2C.bbb\rb2\x041D.W /longer.txt/.F.")
+	check("change of length", read_file("longer.txt"), "bbb\nb2\nc\n")
+	write_file("real.txt", "a\nb\nc\n")
+	os.symlink("real.txt", os.path.join(work, "link.txt"))
+	typed("R /link.txt/.2C.bbb\x04W /link.txt/.F.")
+	check("symbolic link is kept", os.path.islink(os.path.join(work, "link.txt")), True)
+	check("write through symbolic link", read_file("real.txt"), "a\nbbb\nc\n")
+	write_file("h1.txt", "a\nb\nc\n")
+	os.link(os.path.join(work, "h1.txt"), os.path.join(work, "h2.txt"))
+	typed("R /h1.txt/.2C.bbb\x04W /h1.txt/.F.")
+	check("write to hard link", read_file("h1.txt"), "a\nbbb\nc\n")
+	check("write through hard link", read_file("h2.txt"), "a\nbbb\nc\n")
+
+def test_every():
+	"""EVERY marks every addressed line with the pattern in one pass, then runs DELETE, PRINT, SUBSTITUTE or a buffer call on each of them"""
+	write_file("every.txt", "a foo\nb\nc foo\nd foo\ne\n")
+	typed("R /every.txt/.X/foo/D.W /every.txt/.F.")
+	check("EVERY DELETE", read_file("every.txt"), "b\ne\n")
+	write_file("every.txt", "a foo\nb\nc foo\nd foo\ne\n")
+	check("EVERY PRINT in a range", typed("R /every.txt/.2,4X/foo/P.F.").split("\n")[3:5], ["c foo", "d foo"])
+	check("EVERY with no match", "*EVERY /zzz/ PRINT.\n?\n" in typed("R /every.txt/.X/zzz/P.F."), True)
+	output = typed("R /every.txt/.X/foo/S/bar/foo/.W /every.txt/.F.")
+	check("EVERY SUBSTITUTE count", "*EVERY /foo/ SUBSTITUTE /bar/ FOR /foo/.\n3\n" in output, True)
+	check("EVERY SUBSTITUTE", read_file("every.txt"), "a bar\nb\nc bar\nd bar\ne\n")
+	write_file("every.txt", "a foo\nb\nc foo\nd foo\ne\n")
+	output = typed("R /every.txt/.JA..+1D.\x04X/foo/\x02A.W /every.txt/.F.")
+	check("EVERY buffer call skips a deleted mark", read_file("every.txt"), "a foo\nc foo\ne\n")
+	check("EVERY buffer call runs once per mark left", output.count("*.+1DELETE.\n"), 2)
+	output = typed("R /every.txt/.JA.9P.\x04X/foo/\x02A.=F.")
+	check("EVERY stops at an error", (output.count("*9PRINT.?\n"), "*=1\n" in output), (1, True))
+	check("EVERY inside EVERY", "*.EVERY /o/ PRINT.\n?\n" in typed("R /every.txt/.JA..X/o/P.\x04X/foo/\x02A.F."), True)
+
+def test_order():
+	"""ORDER sorts lines by their bytes, or with :N by the number each starts with, and :R reverses the order and :U drops repeated lines"""
+	text = "b\n10 x\n2 y\na\n\n-3 z\nb\n 2 w\na\n"
+	for flags, lines in [("", "\n 2 w\n-3 z\n10 x\n2 y\na\na\nb\nb\n"), (":R", "b\nb\na\na\n2 y\n10 x\n-3 z\n 2 w\n\n"),
+			(":N", "-3 z\n\na\na\nb\nb\n 2 w\n2 y\n10 x\n"), (":U", "\n 2 w\n-3 z\n10 x\n2 y\na\nb\n"), (":N:U", "-3 z\n\na\nb\n 2 w\n2 y\n10 x\n"),
+			(":N:R", "10 x\n2 y\n 2 w\nb\nb\na\na\n\n-3 z\n")]:
+		write_file("order.txt", text)
+		typed("R /order.txt/.O%s.W /order.txt/.F." % flags)
+		check("ORDER%s" % flags, read_file("order.txt"), lines)
+	write_file("order.txt", text)
+	typed("R /order.txt/.2,4O:R.W /order.txt/.F.")
+	check("ORDER of a range", read_file("order.txt"), "b\na\n2 y\n10 x\n\n-3 z\nb\n 2 w\na\n")
+	check("ORDER with a bad flag", "*ORDER:?\n" in typed("R /order.txt/.O:X.F."), True)
+	numbers = ["%d line\n" % ((n * 7919) % 100003 - 50000) for n in range(100000)]
+	write_file("order.txt", "".join(numbers))
+	typed("R /order.txt/.O:N.W /order.txt/.F.")
+	check("ORDER:N of many lines", read_file("order.txt"), "".join(sorted(numbers, key=lambda line: int(line.split()[0]))))
+
+def test_substitute_table():
+	"""SUBSTITUTE:T replaces the leftmost, then longest, of a table's old strings, the first pair winning a tie, and types a count for each pair and the total"""
+	write_file("table", "/dog/cat/\n/DOGGY/cata/\n/x/at/\n/first/cat/\n")
+	write_file("table.txt", "the cat sat\ncatalog cater\nnothing\n")
+	output = typed("R /table.txt/.1,$S:T/table/.W /table.txt/.F.")
+	check("SUBSTITUTE:T", read_file("table.txt"), "the dog sx\nDOGGYlog doger\nnothing\n")
+	check("SUBSTITUTE:T counts", "\n2 /dog/cat/\n1 /DOGGY/cata/\n1 /x/at/\n0 /first/cat/\n4\n" in output, True)
+	write_file("table.txt", "the cat sat\ncatalog cater\nnothing\n")
+	output = typed("R /table.txt/.1,$S:T:1/table/.W /table.txt/.F.")
+	check("SUBSTITUTE:T with a count limit", read_file("table.txt"), "the dog sat\ncatalog cater\nnothing\n")
+	check("SUBSTITUTE:T counts with a count limit", "\n1 /dog/cat/\n0 /DOGGY/cata/\n0 /x/at/\n0 /first/cat/\n1\n" in output, True)
+	write_file("table.txt", "the cat sat\ncatalog cater\nnothing\n")
+	typed("R /table.txt/.X/sat/S:T/table/.W /table.txt/.F.")
+	check("SUBSTITUTE:T under EVERY", read_file("table.txt"), "the dog sx\ncatalog cater\nnothing\n")
+	write_file("table.txt", "the cat sat\n")
+	output = typed("R /table.txt/.JA./dog/cat/\r/Q/t/\r\x041,$S:TA.W /table.txt/.F.")
+	check("SUBSTITUTE:T from a buffer", read_file("table.txt"), "Qhe dog saQ\n")
+	check("SUBSTITUTE:T counts from a buffer", "\n1 /dog/cat/\n2 /Q/t/\n3\n" in output, True)
+	check("SUBSTITUTE:T with a bad table", "*1,$SUBSTITUTE :TA.\n?\n" in typed("R /table.txt/.JA.garbage\r\x041,$S:TA.F."), True)
+	check("SUBSTITUTE:T with an empty buffer", "*1,$SUBSTITUTE :TB.\n?\n" in typed("R /table.txt/.1,$S:TB.F."), True)
+	check("SUBSTITUTE:T with no table file", "\n?\nI-O ERROR.\n" in typed("R /table.txt/.1,$S:T/nofile/.F."), True)
+
+def test_notation():
+	"""NOTATION PATTERNS makes searches, EVERY and SUBSTITUTE take patterns with ., classes, * and anchors, and NOTATION LITERAL goes back to plain strings"""
+	write_file("notation.txt", "foo_bar = 12\n  x9 = 345\nend.\nabc\n*star\n")
+	output = typed("R /notation.txt/.NP.[^ ]=[d.$]=[\\.]=[c$]=[^a]=[[xb]c]=[\\*s]=[a*x9]=[e.*\\.$]=:[a-z_][a-z_0-9]*:=NL.[.]=[a*]=[^a]=F.")
+	searches = [line for line in output.split("\n") if line.startswith("*[") or line.startswith("*:")]
+	check("NOTATION searches", searches, ["*[^ ]=2", "*[d.$]=3", "*[\\.]=3", "*[c$]=4", "*[^a]=4", "*[[xb]c]=4", "*[\\*s]=5", "*[a*x9]=2",
+		"*[e.*\\.$]=3", "*:[a-z_][a-z_0-9]*:=1", "*[.]=3", "*[a*]=?", "*[^a]=?"])
+	output = typed("R /notation.txt/.NP.1,$S/0/[0-9][0-9]*/.4S/-/b*/.W /notation.txt/.F.")
+	check("NOTATION SUBSTITUTE count", "*1,$SUBSTITUTE /0/ FOR /[0-9][0-9]*/.\n3\n" in output, True)
+	check("NOTATION SUBSTITUTE", read_file("notation.txt"), "foo_bar = 0\n  x0 = 0\nend.\n-a-c-\n*star\n")
+	# Far more DFA states than are kept at once, so that the DFA is thrown away and worked out again partway through
+	random.seed(1)
+	lines = ["".join(random.choice("ab") for _ in range(40)) for _ in range(300)]
+	write_file("notation.txt", "\n".join(lines) + "\n")
+	output = typed("R /notation.txt/.NP.X/a%sb$/P.F." % ("[ab]" * 10))
+	check("NOTATION with many DFA states", [line for line in output.split("\n") if line and set(line) <= set("ab")],
+		[line for line in lines if re.search("a[ab]{10}b$", line)])
+
+def test_index_sidecar():
+	"""With -x, a file's search index is saved beside it in a .qedx sidecar, used again while the file is the same, and built again when the file has changed or the sidecar is damaged"""
+	path, sidecar = os.path.join(work, "index.txt"), os.path.join(work, "index.txt.qedx")
+	def search(name, keys, expected):
+		check(name, [line for line in typed("R /index.txt/.%sF." % keys, "-x").split("\n") if line.startswith("*1[") or line.startswith("*[")], expected)
+	write_file("index.txt", "".join("line %d alpha\n" % n for n in range(5000)) + "needle here\n")
+	search("index built", "1[needle]=[absent]=", ["*1[needle]=5001", "*[absent]=?"])
+	check("index sidecar written", os.path.exists(sidecar), True)
+	inode = os.stat(sidecar).st_ino
+	search("index reused", "1[needle]=[line 4999 ]=", ["*1[needle]=5001", "*[line 4999 ]=5000"])
+	check("index sidecar reused", os.stat(sidecar).st_ino, inode)
+	# The same size and modification time, but other contents
+	modified = os.stat(path).st_mtime_ns
+	write_file("index.txt", "".join("line %d alpha\n" % n for n in range(5000)) + "pinned here\n")
+	os.utime(path, ns=(modified, modified))
+	search("stale index", "1[needle]=1[pinned]=", ["*1[needle]=?", "*1[pinned]=5001"])
+	check("stale index sidecar built again", os.stat(sidecar).st_ino != inode, True)
+	with open(sidecar, "r+b") as f:
+		f.seek(64 + 8)
+		f.write(struct.pack("q", 1 << 60))
+	inode = os.stat(sidecar).st_ino
+	search("damaged index table", "1[pinned]=[line 42 ]=", ["*1[pinned]=5001", "*[line 42 ]=43"])
+	check("damaged index sidecar built again", os.stat(sidecar).st_ino != inode, True)
+	with open(sidecar, "r+b") as f:
+		f.truncate(100)
+	search("truncated index", "1[pinned]=", ["*1[pinned]=5001"])
+	check("truncated index sidecar built again", os.path.getsize(sidecar) > 100, True)
+
+def test_continue():
+	"""FINISHED saves the main buffer, the aux buffers, dot and QUICK mode to the continue file, and -c takes them all back"""
+	dump = "/tmp/qed-dump"
+	saved = None
+	if os.path.exists(dump):
+		with open(dump, "rb") as f:
+			saved = f.read()
+	try:
+		write_file("continue.txt", "a\nb\nc\n")
+		typed("R /continue.txt/.1,2LA.2P.NQ.F.")
+		output = typed(".=$UA.1,$P.NF.", "-c")
+		check("continue dot", "*.=2\n" in output, True)
+		check("continue QUICK mode", "*$UA.\n" in output, True)
+		check("continue buffers", output.endswith("\nDOUBLE? NO\na\nb\nc\na\nb\n*F.\nWRITE OUT!\n"), True)
+	finally:
+		if saved is not None:
+			with open(dump, "wb") as f:
+				f.write(saved)
+
+def test_big_file():
+	"""A file over 2 GiB, too big for 32-bit lengths, can be read, searched, substituted, written and saved to the continue file whole. Only run with --big"""
+	if not big:
+		return
+	lines, width = 2300000, 1000
+	with open(os.path.join(work, "big.txt"), "w") as f:
+		for start in range(0, lines, 1000):
+			f.write("".join("%09d %s\n" % (n, "x" * (width - 11)) for n in range(start, start + 1000)))
+	size = lines * width
+	output = typed("R /big.txt/.$=[002299998 ]=$S/ ZZZ/ x/.W /big out.txt/.F.", "-z", "64")
+	check("big file read", "\n%d WORDS.\n" % ((size + 2) // 3) in output, True)
+	check("big file $=", "*$=%d\n" % lines in output, True)
+	check("big file search", "*[002299998 ]=2299999\n" in output, True)
+	last = "002299999 ZZZ" + "x" * (width - 12) + "\n"
+	check("big file written", os.path.getsize(os.path.join(work, "big out.txt")), size + 2)
+	with open(os.path.join(work, "big out.txt"), "rb") as f:
+		f.seek(size + 2 - len(last))
+		check("big file substituted", f.read().decode(), last)
+	os.remove(os.path.join(work, "big.txt"))
+	os.remove(os.path.join(work, "big out.txt"))
+	output = typed("$=$P.NF.", "-z", "64", "-c")
+	check("big file continued", "*$=%d\n" % lines in output, True)
+	check("big file continued text", "\n" + last + "*FINISHED." in output, True)
+	os.remove("/tmp/qed-dump")
+
+def request(sock, keys):
+	"""Sends one server request and returns its status and response"""
+	keys = keys.encode()
+	sock.sendall(b"%d\n" % len(keys) + keys)
+	reply = b""
+	while b"\n" not in reply:
+		reply += sock.recv(65536)
+	head, body = reply.split(b"\n", 1)
+	status, length = head.split()
+	while len(body) < int(length):
+		body += sock.recv(65536)
+	return status.decode(), body.decode()
+
+def test_server_cut_off_append():
+	"""A request that ends partway through the lines of an APPEND, INSERT or CHANGE fails and leaves the main buffer as it was"""
+	path = os.path.join(work, "qed.sock")
+	server = subprocess.Popen([qed, "-s", path], cwd=work, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+	try:
+		for _ in range(100):
+			if os.path.exists(path):
+				break
+			time.sleep(0.01)
+		sock = socket.socket(socket.AF_UNIX)
+		sock.connect(path)
+		check("server append", request(sock, "A.one\rtwo\r\x04")[0], "OK")
+		check("server cut off append", request(sock, "A.three\rfou")[0], "ERROR")
+		check("server cut off insert", request(sock, "1I.zero\r")[0], "ERROR")
+		check("server cut off change", request(sock, "1C.ONE")[0], "ERROR")
+		check("server buffer after cut off requests", request(sock, "1,$P.N"), ("OK", "\r\nDOUBLE? NO\r\none\r\ntwo\r\n"))
+		check("server dot after cut off requests", request(sock, ".="), ("OK", "2\r\n"))
+		sock.close()
+	finally:
+		server.kill()
+		server.wait()
+
+for name, test in list(globals().items()):
+	if name.startswith("test_"):
+		test()
+print("%s" % ("FAILED %d" % failures if failures else "OK"))
+sys.exit(1 if failures else 0)